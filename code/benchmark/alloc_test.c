@@ -0,0 +1,122 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* You need to change this macro to your TFS mount point*/
+#define TESTDIR "/tmp/mountdir"
+
+#define BLOCKSIZE 4096
+#define FSPATHLEN 256
+#define SMALL_FILES 512
+#define TIMED_FILES 128
+#define FILL_BLOCKS 4096
+#define FILEPERM 0666
+#define DIRPERM 0755
+
+/*
+ * Block allocation cost on an empty and on a nearly full volume. Times
+ * TIMED_FILES one-block file creates on the fresh filesystem, then leaves
+ * every other one of SMALL_FILES one-block files as the only free space
+ * behind large fill files and times the same creates again. Run it on a
+ * freshly created disk file.
+ */
+
+char buf[BLOCKSIZE];
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_file(const char *path, int blocks) {
+	int fd = creat(path, FILEPERM);
+	if (fd < 0) {
+		return -1;
+	}
+	int written = 0;
+	for (; written < blocks; written++) {
+		memset(buf, 0x61 + (written % 26), BLOCKSIZE);
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE) {
+			break;
+		}
+	}
+	close(fd);
+	return written;
+}
+
+static int timed_creates(const char *label) {
+	char path[FSPATHLEN];
+	double start = now();
+	for (int i = 0; i < TIMED_FILES; i++) {
+		sprintf(path, "%s/alloc/timed%d", TESTDIR, i);
+		if (write_file(path, 1) != 1) {
+			printf("%s: create failure at file %d\n", label, i);
+			return -1;
+		}
+	}
+	double elapsed = now() - start;
+	printf("%s: %.2f us per one-block file\n", label, elapsed * 1e6 / TIMED_FILES);
+	for (int i = 0; i < TIMED_FILES; i++) {
+		sprintf(path, "%s/alloc/timed%d", TESTDIR, i);
+		unlink(path);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+
+	char path[FSPATHLEN];
+	int fillFiles = 0;
+
+	if (mkdir(TESTDIR "/alloc", DIRPERM) < 0) {
+		perror("mkdir");
+		exit(1);
+	}
+
+	if (timed_creates("empty volume") < 0) {
+		exit(1);
+	}
+
+	/* Interleave small files with the rest of the volume, then punch holes */
+	for (int i = 0; i < SMALL_FILES; i++) {
+		sprintf(path, "%s/alloc/small%d", TESTDIR, i);
+		if (write_file(path, 1) != 1) {
+			printf("Alloc test setup failure \n");
+			exit(1);
+		}
+	}
+	for (;;) {
+		sprintf(path, "%s/alloc/fill%d", TESTDIR, fillFiles++);
+		if (write_file(path, FILL_BLOCKS) != FILL_BLOCKS) {
+			break;
+		}
+	}
+	for (int i = 0; i < SMALL_FILES; i += 2) {
+		sprintf(path, "%s/alloc/small%d", TESTDIR, i);
+		unlink(path);
+	}
+
+	if (timed_creates("nearly full volume") < 0) {
+		exit(1);
+	}
+
+	for (int i = 1; i < SMALL_FILES; i += 2) {
+		sprintf(path, "%s/alloc/small%d", TESTDIR, i);
+		unlink(path);
+	}
+	for (int i = 0; i < fillFiles; i++) {
+		sprintf(path, "%s/alloc/fill%d", TESTDIR, i);
+		unlink(path);
+	}
+	rmdir(TESTDIR "/alloc");
+
+	printf("Alloc test finished\n");
+	return 0;
+}
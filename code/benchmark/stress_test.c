@@ -0,0 +1,141 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+
+/* You need to change this macro to your TFS mount point*/
+#define TESTDIR "/tmp/mountdir"
+
+#define MAX_THREADS 8
+#define BLOCKSIZE 4096
+#define FSPATHLEN 256
+#define FILE_BLOCKS 256
+#define READ_PASSES 8
+#define FILEPERM 0666
+#define DIRPERM 0755
+
+/*
+ * Parallel read throughput. Each run starts 1, 2, 4 and 8 threads that read
+ * FILE_BLOCKS blocks READ_PASSES times, either every thread from a file of
+ * its own or all of them from the same file, and reports MB/s. Mount the
+ * filesystem multithreaded (without -s) so the reads actually overlap.
+ */
+
+struct worker {
+	pthread_t thread;
+	char path[FSPATHLEN];
+	int failed;
+};
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int create_file(const char *path) {
+	char buf[BLOCKSIZE];
+	int fd = creat(path, FILEPERM);
+	if (fd < 0) {
+		perror("creat");
+		return -1;
+	}
+	for (int i = 0; i < FILE_BLOCKS; i++) {
+		memset(buf, 0x61 + (i % 26), BLOCKSIZE);
+		if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE) {
+			perror("write");
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+static void *read_file(void *arg) {
+	struct worker *worker = arg;
+	char buf[BLOCKSIZE];
+	int fd = open(worker->path, O_RDONLY);
+	if (fd < 0) {
+		worker->failed = 1;
+		return NULL;
+	}
+	for (int pass = 0; pass < READ_PASSES; pass++) {
+		for (int i = 0; i < FILE_BLOCKS; i++) {
+			if (pread(fd, buf, BLOCKSIZE, (off_t) i * BLOCKSIZE) != BLOCKSIZE || buf[0] != 0x61 + (i % 26)) {
+				worker->failed = 1;
+				close(fd);
+				return NULL;
+			}
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static int run(int threads, int shared) {
+	struct worker workers[MAX_THREADS];
+	double start = now();
+	for (int i = 0; i < threads; i++) {
+		if (shared) {
+			sprintf(workers[i].path, "%s/stress/file0", TESTDIR);
+		} else {
+			sprintf(workers[i].path, "%s/stress/file%d", TESTDIR, i);
+		}
+		workers[i].failed = 0;
+		pthread_create(&workers[i].thread, NULL, read_file, &workers[i]);
+	}
+	int failed = 0;
+	for (int i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		failed |= workers[i].failed;
+	}
+	double elapsed = now() - start;
+	if (failed) {
+		printf("%s, %d threads: read failure\n", shared ? "same file" : "different files", threads);
+		return -1;
+	}
+	double megabytes = (double) threads * READ_PASSES * FILE_BLOCKS * BLOCKSIZE / (1024 * 1024);
+	printf("%s, %d threads: %.2f MB/s\n", shared ? "same file" : "different files", threads, megabytes / elapsed);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+
+	char path[FSPATHLEN];
+
+	if (mkdir(TESTDIR "/stress", DIRPERM) < 0) {
+		perror("mkdir");
+		exit(1);
+	}
+	for (int i = 0; i < MAX_THREADS; i++) {
+		sprintf(path, "%s/stress/file%d", TESTDIR, i);
+		if (create_file(path) < 0) {
+			printf("Stress test setup failure \n");
+			exit(1);
+		}
+	}
+
+	for (int shared = 0; shared <= 1; shared++) {
+		for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+			if (run(threads, shared) < 0) {
+				exit(1);
+			}
+		}
+	}
+
+	for (int i = 0; i < MAX_THREADS; i++) {
+		sprintf(path, "%s/stress/file%d", TESTDIR, i);
+		unlink(path);
+	}
+	rmdir(TESTDIR "/stress");
+
+	printf("Stress test finished\n");
+	return 0;
+}
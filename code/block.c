@@ -7,31 +7,757 @@
  *
  */
 
+#define _GNU_SOURCE				/* O_DIRECT */
+#include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 
+// linux/fs.h (through io_uring.h) has a BLOCK_SIZE of its own
+#undef BLOCK_SIZE
 #include "block.h"
 
 int diskfile = -1;
+static size_t diskSize = 0;				/* bytes in the disk file */
 
-//Creates a file which is your new emulated disk
-void dev_init(const char* diskfile_path) {
+/*
+ * Buffer cache. Blocks go through a 2Q replacement policy so one pass over
+ * a large file can not push the superblock, bitmaps, directory blocks and
+ * indirect blocks out of the cache:
+ *  - a block seen for the first time enters the A1in FIFO,
+ *  - when it falls off A1in only its number is kept on the A1out ghost list,
+ *  - a block that is referenced again while on A1out is promoted into Am,
+ *    the LRU list for blocks that have proven to be reused.
+ * Writes only dirty the cached copy; dirty blocks are written to the disk file
+ * when evicted or by bio_flush()/bio_sync()/dev_close().
+ *
+ * cacheLock protects the cache. A read miss drops it while reading from the
+ * disk file so misses on different blocks proceed in parallel; if a dirty
+ * block was written back in the meantime (writebackGeneration changed) the
+ * read may be older than the disk file and is retried.
+ *
+ * Requests for several blocks (bio_readv()/bio_writev() and write-back)
+ * go to the disk file as one read or write per run of consecutive block
+ * numbers, all submitted to the I/O backend together.
+ *
+ * bio_prefetch() reads blocks into the cache without waiting for them. Its
+ * completions only queue the data on prefetchDone (the backend may complete
+ * them on a thread that must not wait for cacheLock); whoever takes
+ * cacheLock next installs them, under the same writebackGeneration rule as
+ * a read miss.
+ */
+#define CACHE_QUEUE_A1IN (0)
+#define CACHE_QUEUE_AM (1)
+#define CACHE_A1IN_PERCENT (25)
+#define CACHE_A1OUT_PERCENT (50)
+#define BIO_MAX_RUN (1024)			/* iovecs per preadv/pwritev (UIO_MAXIOV) */
+
+struct cacheBlock {
+	int blockNum;					/* disk block held in data */
+	uint8_t valid;					/* frame holds a block */
+	uint8_t dirty;					/* data is newer than the disk file */
+	uint8_t queue;					/* CACHE_QUEUE_A1IN or CACHE_QUEUE_AM */
+	char* data;						/* BLOCK_SIZE bytes */
+	struct cacheBlock* hashNext;
+	struct cacheBlock* prev;		/* towards the most recently inserted/used */
+	struct cacheBlock* next;		/* towards the next eviction candidate */
+};
+
+struct ghostBlock {
+	int blockNum;
+	struct ghostBlock* hashNext;
+	struct ghostBlock* prev;
+	struct ghostBlock* next;
+};
+
+struct cacheList {
+	struct cacheBlock head;			/* sentinel, head.next is the newest */
+	unsigned int count;
+};
+
+static struct cacheBlock* cacheFrames = NULL;
+static char* cacheData = NULL;
+static struct cacheBlock** cacheBuckets = NULL;
+static unsigned int cacheFrameCount = 0;
+static struct cacheList freeList, a1inList, amList;
+static unsigned int a1inTarget = 0;
+
+static struct ghostBlock* ghostEntries = NULL;
+static struct ghostBlock** ghostBuckets = NULL;
+static struct ghostBlock ghostList;	/* sentinel, ghostList.next is the newest */
+static struct ghostBlock* ghostFree = NULL;	/* unused entries, chained through hashNext */
+static unsigned int ghostCount = 0;
+static unsigned int ghostTarget = 0;
+
+static struct bio_cache_stats cacheStats;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long writebackGeneration = 0;
+static unsigned long diskReads = 0;		/* read requests, updated atomically */
+static unsigned long diskWrites = 0;	/* write requests, updated atomically */
+
+// Blocks read ahead by one bio_prefetch() call
+struct prefetch {
+	unsigned long generation;		/* writebackGeneration when it was submitted */
+	int count;
+	int pending;					/* requests not completed yet */
+	uint8_t failed;
+	int* blockNums;
+	char* data;						/* count * BLOCK_SIZE bytes */
+	struct ioRequest* requests;
+	struct iovec* iov;
+	struct prefetch* next;			/* on prefetchDone */
+};
+
+static struct prefetch* prefetchDone = NULL;	/* completed, not installed yet */
+static unsigned int prefetchInFlight = 0;
+static pthread_mutex_t prefetchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetchIdle = PTHREAD_COND_INITIALIZER;
+
+static void prefetchWait();
+static void journalClose();
+
+/*
+ * I/O backends. Every read or write of the disk file is an ioRequest
+ * covering one run of consecutive blocks, handed to the backend chosen with
+ * dev_set_backend(), which calls request->done once it completed:
+ *  - sync runs it with preadv/pwritev in the calling thread,
+ *  - uring queues it on one io_uring shared by all threads, and a reaper
+ *    thread collects the completions,
+ *  - threads queues it for a pool of worker threads doing preadv/pwritev,
+ *    which is also what uring falls back to when io_uring is unavailable,
+ *  - mmap maps the whole disk file and copies to and from the mapping in
+ *    the calling thread. Written blocks are tracked as one dirty range
+ *    that bio_sync() msyncs, and bio_peek() hands out pointers into the
+ *    mapping so metadata can be parsed without a copy.
+ * Requests are submitted in batches, so a read of several runs or a
+ * write-back has up to the queue depth of them in flight at once.
+ * ioSubmitWait() submits a batch and waits for it.
+ *
+ * With dev_set_direct() the disk file is opened with O_DIRECT, so blocks
+ * are cached once, in the buffer cache, rather than again in the host page
+ * cache. O_DIRECT needs DIRECT_ALIGNMENT aligned memory: the buffer cache
+ * frames are allocated that way, and ioRuns() bounces any other buffer
+ * through a pool of aligned blocks.
+ */
+#define IO_STACK_BLOCKS (32)		/* requests ioRuns() handles without malloc */
+#define IO_MAX_WORKERS (16)
+#define DIRECT_ALIGNMENT (4096)
+#define DIRECT_POOL_BLOCKS (64)			/* aligned bounce blocks kept around */
+
+struct ioRequest;
+typedef void (*ioDoneFunction)(struct ioRequest* request);
+
+struct ioRequest {
+	uint8_t write;					/* pwritev rather than preadv */
+	int blockNum;					/* first block of the run */
+	struct iovec* iov;				/* one BLOCK_SIZE entry per block */
+	int iovcnt;
+	ssize_t result;					/* bytes transferred or -errno */
+	ioDoneFunction done;
+	void* arg;						/* for done */
+	struct ioRequest* next;			/* thread pool queue */
+};
+
+// Requests submitted together by ioSubmitWait()
+struct ioBatch {
+	pthread_mutex_t lock;
+	pthread_cond_t completed;
+	int pending;
+};
+
+struct uringState {
+	int fd;
+	unsigned int entries;
+	void* sqRing;
+	size_t sqRingSize;
+	void* cqRing;
+	size_t cqRingSize;
+	struct io_uring_sqe* sqes;
+	size_t sqesSize;
+	unsigned int* sqTail;
+	unsigned int* sqMask;
+	unsigned int* sqArray;
+	unsigned int* cqHead;
+	unsigned int* cqTail;
+	unsigned int* cqMask;
+	struct io_uring_cqe* cqes;
+	unsigned int inFlight;			/* submitted, completion not reaped yet */
+	int failed;						/* io_uring_enter failed, requests run synchronously */
+	pthread_t reaper;
+	pthread_mutex_t lock;			/* submission queue and inFlight */
+	pthread_cond_t slotFree;
+};
+
+struct threadPool {
+	pthread_t workers[IO_MAX_WORKERS];
+	unsigned int workerCount;
+	struct ioRequest* head;
+	struct ioRequest* tail;
+	int stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+};
+
+static int ioBackend = BIO_BACKEND_SYNC;		/* requested with dev_set_backend() */
+static int ioActiveBackend = BIO_BACKEND_SYNC;	/* running, after any fallback */
+static int ioStarted = 0;
+static unsigned int ioQueueDepth = DEFAULT_QUEUE_DEPTH;
+static struct uringState uring = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .slotFree = PTHREAD_COND_INITIALIZER };
+static struct threadPool pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER };
+
+static int directRequested = 0;			/* set with dev_set_direct() */
+static int diskDirect = 0;				/* disk file is open with O_DIRECT */
+static char* directPool = NULL;			/* DIRECT_POOL_BLOCKS aligned blocks */
+static void* directPoolFree = NULL;		/* free pool blocks, linked through their first bytes */
+static pthread_mutex_t directPoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+static char* diskMap = NULL;			/* the disk file, with the mmap backend */
+static int mapDirtyLow = -1;			/* written blocks [low, high) not yet msynced */
+static int mapDirtyHigh = -1;
+static pthread_mutex_t mapDirtyLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void directPoolInit() {
+	if (directPool != NULL || posix_memalign((void**) &directPool, DIRECT_ALIGNMENT, (size_t) DIRECT_POOL_BLOCKS * BLOCK_SIZE) != 0) {
+		return;
+	}
+	directPoolFree = NULL;
+	for (int index = 0; index < DIRECT_POOL_BLOCKS; index++) {
+		void* block = directPool + (size_t) index * BLOCK_SIZE;
+		*(void**) block = directPoolFree;
+		directPoolFree = block;
+	}
+}
+
+static void directPoolDestroy() {
+	free(directPool);
+	directPool = NULL;
+	directPoolFree = NULL;
+}
+
+// An aligned block from the pool, or a freshly allocated one if it is empty
+static void* directBufferGet() {
+	pthread_mutex_lock(&directPoolLock);
+	void* block = directPoolFree;
+	if (block != NULL) {
+		directPoolFree = *(void**) block;
+	}
+	pthread_mutex_unlock(&directPoolLock);
+	if (block == NULL && posix_memalign(&block, DIRECT_ALIGNMENT, BLOCK_SIZE) != 0) {
+		return NULL;
+	}
+	return block;
+}
+
+static void directBufferPut(void* block) {
+	char* address = block;
+	if (directPool == NULL || address < directPool || address >= directPool + (size_t) DIRECT_POOL_BLOCKS * BLOCK_SIZE) {
+		free(block);
+		return;
+	}
+	pthread_mutex_lock(&directPoolLock);
+	*(void**) block = directPoolFree;
+	directPoolFree = block;
+	pthread_mutex_unlock(&directPoolLock);
+}
+
+// Copies a request to or from the mapping, returns bytes transferred
+static ssize_t mapExecute(struct ioRequest* request) {
+	size_t offset = (size_t) request->blockNum * BLOCK_SIZE;
+	ssize_t transferred = 0;
+	for (int index = 0; index < request->iovcnt && offset < diskSize; index++) {
+		size_t length = request->iov[index].iov_len;
+		if (length > diskSize - offset) {
+			length = diskSize - offset;
+		}
+		if (request->write) {
+			memcpy(diskMap + offset, request->iov[index].iov_base, length);
+		} else {
+			memcpy(request->iov[index].iov_base, diskMap + offset, length);
+		}
+		offset += length;
+		transferred += length;
+	}
+	if (request->write && transferred > 0) {
+		int last = request->blockNum + (transferred + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		pthread_mutex_lock(&mapDirtyLock);
+		if (mapDirtyLow == -1 || request->blockNum < mapDirtyLow) {
+			mapDirtyLow = request->blockNum;
+		}
+		if (last > mapDirtyHigh) {
+			mapDirtyHigh = last;
+		}
+		pthread_mutex_unlock(&mapDirtyLock);
+	}
+	return transferred;
+}
+
+static int mapStart() {
+	struct stat diskStat;
+	if (fstat(diskfile, &diskStat) < 0) {
+		return -1;
+	}
+	// Blocks past the end of a short disk file read as zeroes, as they do
+	// with pread, instead of faulting
+	if ((size_t) diskStat.st_size < diskSize && ftruncate(diskfile, diskSize) < 0) {
+		return -1;
+	}
+	void* map = mmap(NULL, diskSize, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	diskMap = map;
+	mapDirtyLow = -1;
+	mapDirtyHigh = -1;
+	return 0;
+}
+
+// Writes the dirty range of the mapping back to the disk file
+static int mapSync() {
+	pthread_mutex_lock(&mapDirtyLock);
+	int low = mapDirtyLow;
+	int high = mapDirtyHigh;
+	mapDirtyLow = -1;
+	mapDirtyHigh = -1;
+	pthread_mutex_unlock(&mapDirtyLock);
+	if (low == -1) {
+		return 0;
+	}
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	size_t start = ((size_t) low * BLOCK_SIZE) & ~(pageSize - 1);
+	size_t end = (size_t) high * BLOCK_SIZE;
+	if (end > diskSize) {
+		end = diskSize;
+	}
+	if (msync(diskMap + start, end - start, MS_SYNC) < 0) {
+		perror("block_sync failed");
+		return -1;
+	}
+	return 0;
+}
+
+static void mapStop() {
+	mapSync();
+	munmap(diskMap, diskSize);
+	diskMap = NULL;
+}
+
+// Runs a request with preadv/pwritev, returns bytes transferred or -errno
+static ssize_t ioExecute(struct ioRequest* request) {
+	if (diskMap != NULL) {
+		__atomic_fetch_add(request->write ? &diskWrites : &diskReads, 1, __ATOMIC_RELAXED);
+		return mapExecute(request);
+	}
+	off_t offset = (off_t) request->blockNum * BLOCK_SIZE;
+	ssize_t retstat;
+	if (request->write) {
+		__atomic_fetch_add(&diskWrites, 1, __ATOMIC_RELAXED);
+		retstat = pwritev(diskfile, request->iov, request->iovcnt, offset);
+	} else {
+		__atomic_fetch_add(&diskReads, 1, __ATOMIC_RELAXED);
+		retstat = preadv(diskfile, request->iov, request->iovcnt, offset);
+	}
+	return retstat < 0 ? -errno : retstat;
+}
+
+static void ioFinish(struct ioRequest* request, ssize_t result) {
+	request->result = result;
+	request->done(request);
+}
+
+static int uringEnter(unsigned int toSubmit, unsigned int minComplete, unsigned int flags) {
+	return syscall(__NR_io_uring_enter, uring.fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static void uringUnmap() {
+	if (uring.sqes != NULL && uring.sqes != MAP_FAILED) {
+		munmap(uring.sqes, uring.sqesSize);
+	}
+	if (uring.cqRing != NULL && uring.cqRing != MAP_FAILED && uring.cqRing != uring.sqRing) {
+		munmap(uring.cqRing, uring.cqRingSize);
+	}
+	if (uring.sqRing != NULL && uring.sqRing != MAP_FAILED) {
+		munmap(uring.sqRing, uring.sqRingSize);
+	}
+	uring.sqes = NULL;
+	uring.cqRing = NULL;
+	uring.sqRing = NULL;
+	if (uring.fd >= 0) {
+		close(uring.fd);
+		uring.fd = -1;
+	}
+}
+
+/*
+ * Collects completions until it reaps the stop request (user_data 0). The
+ * completion queue entries are copied out and the lock taken before any
+ * request is finished, so done callbacks run outside uring.lock and after
+ * everything the submitter did before queueing the request.
+ */
+static void* uringReap(void* unused) {
+	struct io_uring_cqe completions[IO_STACK_BLOCKS];
+	int stopping = 0;
+	while (!stopping) {
+		unsigned int head = *uring.cqHead;
+		unsigned int tail = __atomic_load_n(uring.cqTail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (uringEnter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+				// Once the ring is unusable uringSubmit() no longer queues on
+				// it, so the reaper is done when the last request completed
+				pthread_mutex_lock(&uring.lock);
+				stopping = uring.failed && uring.inFlight == 0;
+				pthread_mutex_unlock(&uring.lock);
+			}
+			continue;
+		}
+		unsigned int completed = 0;
+		for (; head != tail && completed < IO_STACK_BLOCKS; head++) {
+			completions[completed++] = uring.cqes[head & *uring.cqMask];
+		}
+		__atomic_store_n(uring.cqHead, head, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&uring.lock);
+		uring.inFlight -= completed;
+		pthread_cond_broadcast(&uring.slotFree);
+		pthread_mutex_unlock(&uring.lock);
+		for (unsigned int index = 0; index < completed; index++) {
+			struct ioRequest* request = (struct ioRequest*) (uintptr_t) completions[index].user_data;
+			if (request == NULL) {
+				stopping = 1;
+			} else {
+				ioFinish(request, completions[index].res);
+			}
+		}
+	}
+	return NULL;
+}
+
+static int uringStart(unsigned int depth) {
+	if (uring.failed) {
+		// The failed ring and its reaper were left behind by uringStop()
+		return -1;
+	}
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	uring.fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (uring.fd < 0) {
+		return -1;
+	}
+	uring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	uring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring.cqRingSize > uring.sqRingSize) {
+			uring.sqRingSize = uring.cqRingSize;
+		}
+		uring.cqRingSize = uring.sqRingSize;
+	}
+	uring.sqRing = mmap(NULL, uring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		uring.cqRing = uring.sqRing;
+	} else {
+		uring.cqRing = mmap(NULL, uring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+	}
+	uring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring.sqes = mmap(NULL, uring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+	if (uring.sqRing == MAP_FAILED || uring.cqRing == MAP_FAILED || uring.sqes == MAP_FAILED) {
+		uringUnmap();
+		return -1;
+	}
+	char* sqRing = uring.sqRing;
+	char* cqRing = uring.cqRing;
+	uring.sqTail = (unsigned int*) (sqRing + params.sq_off.tail);
+	uring.sqMask = (unsigned int*) (sqRing + params.sq_off.ring_mask);
+	uring.sqArray = (unsigned int*) (sqRing + params.sq_off.array);
+	uring.cqHead = (unsigned int*) (cqRing + params.cq_off.head);
+	uring.cqTail = (unsigned int*) (cqRing + params.cq_off.tail);
+	uring.cqMask = (unsigned int*) (cqRing + params.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe*) (cqRing + params.cq_off.cqes);
+	uring.entries = params.sq_entries;
+	uring.inFlight = 0;
+	if (pthread_create(&uring.reaper, NULL, uringReap, NULL) != 0) {
+		uringUnmap();
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Queues requests (NULL for the reaper's stop request), at most entries in
+ * flight. If io_uring_enter fails for good, the entries the kernel did not
+ * take are withdrawn from the queue and those requests, like all later ones,
+ * are executed synchronously.
+ */
+static void uringSubmit(struct ioRequest** requests, int count) {
+	pthread_mutex_lock(&uring.lock);
+	int submitted = 0;
+	while (submitted < count && !uring.failed) {
+		while (uring.inFlight >= uring.entries && !uring.failed) {
+			pthread_cond_wait(&uring.slotFree, &uring.lock);
+		}
+		if (uring.failed) {
+			break;
+		}
+		unsigned int tail = *uring.sqTail;
+		unsigned int queued = 0;
+		for (; submitted < count && uring.inFlight < uring.entries; submitted++) {
+			struct ioRequest* request = requests[submitted];
+			unsigned int index = tail & *uring.sqMask;
+			struct io_uring_sqe* sqe = &uring.sqes[index];
+			memset(sqe, 0, sizeof(*sqe));
+			if (request == NULL) {
+				sqe->opcode = IORING_OP_NOP;
+			} else {
+				sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+				sqe->fd = diskfile;
+				sqe->addr = (uintptr_t) request->iov;
+				sqe->len = request->iovcnt;
+				sqe->off = (off_t) request->blockNum * BLOCK_SIZE;
+				__atomic_fetch_add(request->write ? &diskWrites : &diskReads, 1, __ATOMIC_RELAXED);
+			}
+			sqe->user_data = (uintptr_t) request;
+			uring.sqArray[index] = index;
+			tail++;
+			queued++;
+			uring.inFlight++;
+		}
+		__atomic_store_n(uring.sqTail, tail, __ATOMIC_RELEASE);
+		while (queued > 0) {
+			int entered = uringEnter(queued, 0, 0);
+			if (entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				perror("io_uring_enter failed");
+				tail -= queued;
+				__atomic_store_n(uring.sqTail, tail, __ATOMIC_RELEASE);
+				uring.inFlight -= queued;
+				submitted -= queued;
+				for (int index = submitted; index < submitted + (int) queued; index++) {
+					if (requests[index] != NULL) {
+						__atomic_fetch_sub(requests[index]->write ? &diskWrites : &diskReads, 1, __ATOMIC_RELAXED);
+					}
+				}
+				uring.failed = 1;
+				pthread_cond_broadcast(&uring.slotFree);
+				break;
+			}
+			queued -= entered > 0 ? entered : 0;
+		}
+	}
+	pthread_mutex_unlock(&uring.lock);
+	
+	for (; submitted < count; submitted++) {
+		if (requests[submitted] != NULL) {
+			ioFinish(requests[submitted], ioExecute(requests[submitted]));
+		}
+	}
+}
+
+static void uringStop() {
+	struct ioRequest* stop = NULL;
+	uringSubmit(&stop, 1);
+	if (uring.failed) {
+		// The stop request could not be queued and the reaper may wait in
+		// the kernel for good, so it is left behind along with the ring
+		pthread_detach(uring.reaper);
+		return;
+	}
+	pthread_join(uring.reaper, NULL);
+	uringUnmap();
+}
+
+static void* poolWork(void* unused) {
+	pthread_mutex_lock(&pool.lock);
+	while (1) {
+		while (pool.head == NULL && !pool.stopping) {
+			pthread_cond_wait(&pool.work, &pool.lock);
+		}
+		if (pool.head == NULL) {
+			break;
+		}
+		struct ioRequest* request = pool.head;
+		pool.head = request->next;
+		if (pool.head == NULL) {
+			pool.tail = NULL;
+		}
+		pthread_mutex_unlock(&pool.lock);
+		ioFinish(request, ioExecute(request));
+		pthread_mutex_lock(&pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+static int poolStart(unsigned int depth) {
+	pool.head = NULL;
+	pool.tail = NULL;
+	pool.stopping = 0;
+	pool.workerCount = 0;
+	unsigned int workers = depth < IO_MAX_WORKERS ? depth : IO_MAX_WORKERS;
+	while (pool.workerCount < workers) {
+		if (pthread_create(&pool.workers[pool.workerCount], NULL, poolWork, NULL) != 0) {
+			break;
+		}
+		pool.workerCount++;
+	}
+	return pool.workerCount > 0 ? 0 : -1;
+}
+
+static void poolSubmit(struct ioRequest** requests, int count) {
+	pthread_mutex_lock(&pool.lock);
+	for (int index = 0; index < count; index++) {
+		requests[index]->next = NULL;
+		if (pool.tail == NULL) {
+			pool.head = requests[index];
+		} else {
+			pool.tail->next = requests[index];
+		}
+		pool.tail = requests[index];
+	}
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// Lets the workers finish the queue and exit
+static void poolStop() {
+	pthread_mutex_lock(&pool.lock);
+	pool.stopping = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+	for (unsigned int worker = 0; worker < pool.workerCount; worker++) {
+		pthread_join(pool.workers[worker], NULL);
+	}
+	pool.workerCount = 0;
+}
+
+// Starts the requested backend once the disk file is open
+static void ioStart() {
+	if (ioStarted) {
+		return;
+	}
+	ioActiveBackend = ioBackend;
+	if (ioActiveBackend == BIO_BACKEND_MMAP && mapStart() == -1) {
+		printf("[W-BACKEND]: Could not map the disk file, using synchronous I/O\n");
+		ioActiveBackend = BIO_BACKEND_SYNC;
+	}
+	if (ioActiveBackend == BIO_BACKEND_URING && uringStart(ioQueueDepth) == -1) {
+		printf("[W-BACKEND]: io_uring is not available, using the thread pool\n");
+		ioActiveBackend = BIO_BACKEND_THREADS;
+	}
+	if (ioActiveBackend == BIO_BACKEND_THREADS && poolStart(ioQueueDepth) == -1) {
+		printf("[W-BACKEND]: Could not start I/O threads, using synchronous I/O\n");
+		ioActiveBackend = BIO_BACKEND_SYNC;
+	}
+	ioStarted = 1;
+}
+
+// Waits for outstanding requests and stops the backend's threads
+static void ioStop() {
+	if (!ioStarted) {
+		return;
+	}
+	if (ioActiveBackend == BIO_BACKEND_URING) {
+		uringStop();
+	} else if (ioActiveBackend == BIO_BACKEND_THREADS) {
+		poolStop();
+	} else if (ioActiveBackend == BIO_BACKEND_MMAP) {
+		mapStop();
+	}
+	ioActiveBackend = BIO_BACKEND_SYNC;
+	ioStarted = 0;
+}
+
+static void ioSubmit(struct ioRequest** requests, int count) {
+	if (ioActiveBackend == BIO_BACKEND_URING) {
+		uringSubmit(requests, count);
+	} else if (ioActiveBackend == BIO_BACKEND_THREADS) {
+		poolSubmit(requests, count);
+	} else {
+		for (int index = 0; index < count; index++) {
+			ioFinish(requests[index], ioExecute(requests[index]));
+		}
+	}
+}
+
+static void ioBatchDone(struct ioRequest* request) {
+	struct ioBatch* batch = request->arg;
+	pthread_mutex_lock(&batch->lock);
+	if (--batch->pending == 0) {
+		pthread_cond_signal(&batch->completed);
+	}
+	pthread_mutex_unlock(&batch->lock);
+}
+
+static void ioSubmitWait(struct ioRequest* requests, int count) {
+	struct ioRequest* stackPointers[IO_STACK_BLOCKS];
+	struct ioRequest** pointers = count <= IO_STACK_BLOCKS ? stackPointers : malloc(count * sizeof(struct ioRequest*));
+	if (pointers == NULL) {
+		// Fall back to running them here one at a time
+		for (int index = 0; index < count; index++) {
+			requests[index].result = ioExecute(&requests[index]);
+		}
+		return;
+	}
+	struct ioBatch batch;
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.completed, NULL);
+	batch.pending = count;
+	for (int index = 0; index < count; index++) {
+		requests[index].done = ioBatchDone;
+		requests[index].arg = &batch;
+		pointers[index] = &requests[index];
+	}
+	ioSubmit(pointers, count);
+	pthread_mutex_lock(&batch.lock);
+	while (batch.pending > 0) {
+		pthread_cond_wait(&batch.completed, &batch.lock);
+	}
+	pthread_mutex_unlock(&batch.lock);
+	pthread_cond_destroy(&batch.completed);
+	pthread_mutex_destroy(&batch.lock);
+	if (pointers != stackPointers) {
+		free(pointers);
+	}
+}
+
+// Opens the disk file, with O_DIRECT if it was asked for and is supported
+static int openDisk(const char* diskfile_path, int flags) {
+	diskDirect = 0;
+	if (directRequested) {
+		int fd = open(diskfile_path, flags | O_DIRECT, S_IRUSR | S_IWUSR);
+		if (fd >= 0) {
+			diskDirect = 1;
+			directPoolInit();
+			return fd;
+		}
+		if (errno != EINVAL) {
+			return fd;
+		}
+		printf("[W-DIRECT]: O_DIRECT is not supported for %s, using buffered I/O\n", diskfile_path);
+	}
+	return open(diskfile_path, flags, S_IRUSR | S_IWUSR);
+}
+
+// Creates (or empties) the disk file and sizes it to size bytes
+void dev_init(const char* diskfile_path, size_t size) {
     if (diskfile >= 0) {
 		return;
     }
     
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    diskfile = openDisk(diskfile_path, O_CREAT | O_TRUNC | O_RDWR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		exit(EXIT_FAILURE);
     }
 	
-    ftruncate(diskfile, DISK_SIZE);
+    ftruncate(diskfile, size);
+    diskSize = size;
+    ioStart();
 }
 
 //Function to open the disk file
@@ -40,40 +766,1527 @@ int dev_open(const char* diskfile_path) {
 		return 0;
     }
     
-    diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
+    diskfile = openDisk(diskfile_path, O_RDWR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		return -1;
     }
+    struct stat diskStat;
+    diskSize = fstat(diskfile, &diskStat) == 0 ? diskStat.st_size : 0;
+    ioStart();
 	return 0;
 }
 
 void dev_close() {
     if (diskfile >= 0) {
+		prefetchWait();
+		journalClose();
+		bio_flush();
+		ioStop();
 		close(diskfile);
+		diskfile = -1;
+		diskDirect = 0;
+		directPoolDestroy();
     }
+    dev_cache_destroy();
+}
+
+static void listInit(struct cacheList* list) {
+	list->head.next = &list->head;
+	list->head.prev = &list->head;
+	list->count = 0;
+}
+
+static void listRemove(struct cacheList* list, struct cacheBlock* block) {
+	block->prev->next = block->next;
+	block->next->prev = block->prev;
+	list->count--;
+}
+
+static void listPushFront(struct cacheList* list, struct cacheBlock* block) {
+	block->next = list->head.next;
+	block->prev = &list->head;
+	list->head.next->prev = block;
+	list->head.next = block;
+	list->count++;
+}
+
+// The eviction candidate of a list, NULL if the list is empty
+static struct cacheBlock* listBack(struct cacheList* list) {
+	return list->count == 0 ? NULL : list->head.prev;
+}
+
+static unsigned int cacheHash(int block_num) {
+	return ((unsigned int) block_num) % cacheFrameCount;
+}
+
+static struct cacheBlock* cacheLookup(int block_num) {
+	struct cacheBlock* block = cacheBuckets[cacheHash(block_num)];
+	while (block != NULL && block->blockNum != block_num) {
+		block = block->hashNext;
+	}
+	return block;
+}
+
+static void cacheUnhash(struct cacheBlock* block) {
+	struct cacheBlock** link = &cacheBuckets[cacheHash(block->blockNum)];
+	while (*link != block) {
+		link = &((*link)->hashNext);
+	}
+	*link = block->hashNext;
+	block->hashNext = NULL;
+}
+
+static struct ghostBlock* ghostLookup(int block_num) {
+	struct ghostBlock* ghost = ghostBuckets[cacheHash(block_num)];
+	while (ghost != NULL && ghost->blockNum != block_num) {
+		ghost = ghost->hashNext;
+	}
+	return ghost;
+}
+
+static void ghostRemove(struct ghostBlock* ghost) {
+	struct ghostBlock** link = &ghostBuckets[cacheHash(ghost->blockNum)];
+	while (*link != ghost) {
+		link = &((*link)->hashNext);
+	}
+	*link = ghost->hashNext;
+	ghost->prev->next = ghost->next;
+	ghost->next->prev = ghost->prev;
+	ghostCount--;
+}
+
+// Remembers that block_num was recently evicted from A1in
+static void ghostInsert(int block_num) {
+	if (ghostTarget == 0) {
+		return;
+	}
+	struct ghostBlock* ghost = ghostFree;
+	if (ghost != NULL) {
+		ghostFree = ghost->hashNext;
+	} else {
+		// Ghost list is full, forget the oldest evicted block
+		ghost = ghostList.prev;
+		ghostRemove(ghost);
+	}
+	ghost->blockNum = block_num;
+	ghost->hashNext = ghostBuckets[cacheHash(block_num)];
+	ghostBuckets[cacheHash(block_num)] = ghost;
+	ghost->next = ghostList.next;
+	ghost->prev = &ghostList;
+	ghostList.next->prev = ghost;
+	ghostList.next = ghost;
+	ghostCount++;
+}
+
+// Number of entries from first on whose block numbers follow each other
+static int runLength(const int* block_nums, int first, int count) {
+	int length = 1;
+	while (first + length < count && length < BIO_MAX_RUN && block_nums[first + length] == block_nums[first] + length) {
+		length++;
+	}
+	return length;
+}
+
+/*
+ * Reads (or writes) block_nums[i] into (from) bufs[i] for count blocks,
+ * with one request per run of consecutive block numbers, submitted as one
+ * batch. Whatever lies beyond the end of the disk file reads as zeroes.
+ * Returns 0, or -1 if any request failed.
+ */
+static int ioRuns(int write, const int* block_nums, void* const* bufs, int count) {
+	struct ioRequest stackRequests[IO_STACK_BLOCKS];
+	struct iovec stackIov[IO_STACK_BLOCKS];
+	struct ioRequest* requests = stackRequests;
+	struct iovec* iov = stackIov;
+	if (count > IO_STACK_BLOCKS) {
+		requests = malloc(count * sizeof(struct ioRequest));
+		iov = malloc(count * sizeof(struct iovec));
+		if (requests == NULL || iov == NULL) {
+			free(requests);
+			free(iov);
+			return -1;
+		}
+	}
+	int runs = 0;
+	for (int first = 0; first < count; ) {
+		int length = runLength(block_nums, first, count);
+		for (int index = first; index < first + length; index++) {
+			iov[index].iov_base = bufs[index];
+			iov[index].iov_len = BLOCK_SIZE;
+		}
+		if (diskDirect && diskMap == NULL) {
+			for (int index = first; index < first + length; index++) {
+				if ((uintptr_t) bufs[index] % DIRECT_ALIGNMENT == 0) {
+					continue;
+				}
+				void* bounce = directBufferGet();
+				if (bounce != NULL) {
+					if (write) {
+						memcpy(bounce, bufs[index], BLOCK_SIZE);
+					}
+					iov[index].iov_base = bounce;
+				}
+			}
+		}
+		requests[runs].write = write;
+		requests[runs].blockNum = block_nums[first];
+		requests[runs].iov = iov + first;
+		requests[runs].iovcnt = length;
+		runs++;
+		first += length;
+	}
+	ioSubmitWait(requests, runs);
+	
+	int retstat = 0;
+	for (int run = 0; run < runs; run++) {
+		ssize_t result = requests[run].result;
+		if (result < 0) {
+			errno = -result;
+			perror(write ? "block_write failed" : "block_read failed");
+			retstat = -1;
+			result = 0;
+		}
+		if (!write) {
+			for (int index = result / BLOCK_SIZE; index < requests[run].iovcnt; index++) {
+				size_t valid = index == result / BLOCK_SIZE ? result % BLOCK_SIZE : 0;
+				memset((char*) requests[run].iov[index].iov_base + valid, 0, BLOCK_SIZE - valid);
+			}
+		}
+	}
+	for (int index = 0; index < count; index++) {
+		if (iov[index].iov_base != bufs[index]) {
+			if (!write) {
+				memcpy(bufs[index], iov[index].iov_base, BLOCK_SIZE);
+			}
+			directBufferPut(iov[index].iov_base);
+		}
+	}
+	if (requests != stackRequests) {
+		free(requests);
+		free(iov);
+	}
+	return retstat;
+}
+
+static int writeBack(struct cacheBlock* block) {
+	void* data = block->data;
+	if (ioRuns(1, &block->blockNum, &data, 1) < 0) {
+		return -1;
+	}
+	block->dirty = 0;
+	cacheStats.writebacks++;
+	writebackGeneration++;
+	return BLOCK_SIZE;
+}
+
+/*
+ * Returns an unused frame, evicting a block if every frame is in use.
+ * A1in gives up its oldest block while it is over its share of the cache,
+ * otherwise the least recently used block of Am is evicted. A dirty victim
+ * that cannot be written back stays cached (and dirty) at the front of its
+ * queue and the next one is tried; returns NULL if no frame could be freed.
+ */
+static struct cacheBlock* cacheGetFrame() {
+	struct cacheBlock* victim = listBack(&freeList);
+	if (victim != NULL) {
+		listRemove(&freeList, victim);
+		return victim;
+	}
+	
+	for (int attempt = 0; ; attempt++) {
+		if (attempt == cacheFrameCount) {
+			printf("[E-CACHE]: No cached block could be written back to free a frame\n");
+			return NULL;
+		}
+		struct cacheList* queue = &amList;
+		if (a1inList.count > a1inTarget || amList.count == 0) {
+			queue = &a1inList;
+		}
+		victim = listBack(queue);
+		listRemove(queue, victim);
+		if (victim->dirty && writeBack(victim) < 0) {
+			listPushFront(queue, victim);
+			continue;
+		}
+		if (queue == &a1inList) {
+			ghostInsert(victim->blockNum);
+		}
+		break;
+	}
+	cacheUnhash(victim);
+	victim->valid = 0;
+	cacheStats.evictions++;
+	return victim;
+}
+
+/*
+ * Places a block that just missed in the cache into A1in or, if it was seen
+ * recently, Am. Returns NULL if no frame could be freed for it.
+ */
+static struct cacheBlock* cacheInsert(int block_num) {
+	struct cacheBlock* block = cacheGetFrame();
+	if (block == NULL) {
+		return NULL;
+	}
+	block->blockNum = block_num;
+	block->valid = 1;
+	block->dirty = 0;
+	block->hashNext = cacheBuckets[cacheHash(block_num)];
+	cacheBuckets[cacheHash(block_num)] = block;
+	
+	struct ghostBlock* ghost = ghostLookup(block_num);
+	if (ghost != NULL) {
+		ghostRemove(ghost);
+		ghost->hashNext = ghostFree;
+		ghostFree = ghost;
+		block->queue = CACHE_QUEUE_AM;
+		listPushFront(&amList, block);
+	} else {
+		block->queue = CACHE_QUEUE_A1IN;
+		listPushFront(&a1inList, block);
+	}
+	return block;
+}
+
+// A hit in Am refreshes the block, a hit in A1in leaves it in place (correlated references)
+static void cacheTouch(struct cacheBlock* block) {
+	if (block->queue == CACHE_QUEUE_AM) {
+		listRemove(&amList, block);
+		listPushFront(&amList, block);
+	}
+}
+
+static void prefetchFree(struct prefetch* prefetch) {
+	free(prefetch->blockNums);
+	free(prefetch->data);
+	free(prefetch->requests);
+	free(prefetch->iov);
+	free(prefetch);
+}
+
+// Completion of one run of a prefetch; may run on a backend thread
+static void prefetchRequestDone(struct ioRequest* request) {
+	struct prefetch* prefetch = request->arg;
+	pthread_mutex_lock(&prefetchLock);
+	if (request->result < 0) {
+		prefetch->failed = 1;
+	} else if (request->result < (ssize_t) request->iovcnt * BLOCK_SIZE) {
+		// Past the end of the disk file
+		memset((char*) request->iov[0].iov_base + request->result, 0, (size_t) request->iovcnt * BLOCK_SIZE - request->result);
+	}
+	if (--prefetch->pending == 0) {
+		prefetch->next = prefetchDone;
+		__atomic_store_n(&prefetchDone, prefetch, __ATOMIC_RELAXED);
+		prefetchInFlight--;
+		pthread_cond_broadcast(&prefetchIdle);
+	}
+	pthread_mutex_unlock(&prefetchLock);
+}
+
+/*
+ * Moves completed prefetches into the cache. Caller holds cacheLock. A
+ * block that got cached meanwhile keeps its cached copy, and once a dirty
+ * block was written back (even by an insert made here) the rest is dropped,
+ * as it may be older than the disk file.
+ */
+static void prefetchInstall() {
+	if (__atomic_load_n(&prefetchDone, __ATOMIC_RELAXED) == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&prefetchLock);
+	struct prefetch* completed = prefetchDone;
+	__atomic_store_n(&prefetchDone, NULL, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&prefetchLock);
+	while (completed != NULL) {
+		struct prefetch* prefetch = completed;
+		completed = prefetch->next;
+		for (int index = 0; index < prefetch->count && !prefetch->failed; index++) {
+			if (prefetch->generation != writebackGeneration) {
+				break;
+			}
+			if (cacheLookup(prefetch->blockNums[index]) == NULL) {
+				struct cacheBlock* block = cacheInsert(prefetch->blockNums[index]);
+				if (block == NULL) {
+					break;
+				}
+				memcpy(block->data, prefetch->data + (size_t) index * BLOCK_SIZE, BLOCK_SIZE);
+				cacheStats.prefetched++;
+			}
+		}
+		prefetchFree(prefetch);
+	}
+}
+
+// Waits for prefetches in flight and drops the ones not installed
+static void prefetchWait() {
+	pthread_mutex_lock(&prefetchLock);
+	while (prefetchInFlight > 0) {
+		pthread_cond_wait(&prefetchIdle, &prefetchLock);
+	}
+	struct prefetch* completed = prefetchDone;
+	__atomic_store_n(&prefetchDone, NULL, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&prefetchLock);
+	while (completed != NULL) {
+		struct prefetch* prefetch = completed;
+		completed = prefetch->next;
+		prefetchFree(prefetch);
+	}
+}
+
+/*
+ * Metadata journal. Blocks written with bio_write_meta() are not written in
+ * place right away: journalTable holds them until a commit has logged
+ * them, and every read or write of such a block is served from the table.
+ * bio_journal_snapshot() turns the blocks changed since the last snapshot
+ * into one transaction and bio_journal_commit() appends it to the log
+ * (together with the dirty buffer cache blocks) and makes both durable
+ * with a single fdatasync. Once the log is half full the committed blocks
+ * are checkpointed (written in place and synced) and the log starts over.
+ * A block changed again after it was logged keeps its committed version
+ * for that, since the new one may not be written in place before it is
+ * committed.
+ *
+ * journalLock serialises commits and checkpoints; it is held from
+ * bio_journal_snapshot() until bio_journal_commit() returns and is taken
+ * before cacheLock, which protects the table.
+ */
+#define JOURNAL_BUCKETS (1024)
+#define JOURNAL_CHECKSUM_SEED (2166136261u)
+
+struct journalBlock {
+	int blockNum;
+	uint8_t running;				/* changed since the last snapshot */
+	uint8_t snapshotted;			/* in a transaction that is being committed */
+	uint8_t logged;					/* a committed version is in the log */
+	char* data;						/* current contents */
+	char* committed;				/* committed version while data is newer, else NULL */
+	struct journalBlock* hashNext;
+};
+
+// One transaction: the images of its blocks, in blockNums order
+struct bio_txn {
+	unsigned int count;				/* blocks in the transaction */
+	int* blockNums;
+	char* images;					/* count * BLOCK_SIZE bytes */
+};
+
+static struct journalBlock* journalTable[JOURNAL_BUCKETS];
+static int journalRegion = 0;			/* first block of the journal region */
+static unsigned int journalLength = 0;	/* blocks in the region, 0 while there is no journal */
+static unsigned int journalHead = 1;	/* next free log block */
+static uint32_t journalSequence = 1;	/* sequence number of the next transaction */
+static unsigned int journalRunning = 0;	/* running blocks in the table */
+static pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct journalBlock* journalLookup(int block_num) {
+	struct journalBlock* entry = journalTable[(unsigned int) block_num % JOURNAL_BUCKETS];
+	while (entry != NULL && entry->blockNum != block_num) {
+		entry = entry->hashNext;
+	}
+	return entry;
+}
+
+/*
+ * Stores a new version of block_num in the table. The first time a block is
+ * stored the journal takes it over from the buffer cache, so a dirty cached
+ * copy is not written back over it. Caller holds cacheLock.
+ */
+static int journalStore(int block_num, const void* buf) {
+	struct journalBlock* entry = journalLookup(block_num);
+	if (entry == NULL) {
+		entry = calloc(1, sizeof(struct journalBlock));
+		if (entry == NULL || posix_memalign((void**) &entry->data, DIRECT_ALIGNMENT, BLOCK_SIZE) != 0) {
+			free(entry);
+			return -1;
+		}
+		entry->blockNum = block_num;
+		entry->hashNext = journalTable[(unsigned int) block_num % JOURNAL_BUCKETS];
+		journalTable[(unsigned int) block_num % JOURNAL_BUCKETS] = entry;
+		struct cacheBlock* block = cacheFrameCount > 0 ? cacheLookup(block_num) : NULL;
+		if (block != NULL) {
+			block->dirty = 0;
+		}
+	} else if (entry->logged && !entry->running && entry->committed == NULL) {
+		entry->committed = malloc(BLOCK_SIZE);
+		if (entry->committed == NULL) {
+			return -1;
+		}
+		memcpy(entry->committed, entry->data, BLOCK_SIZE);
+	}
+	memcpy(entry->data, buf, BLOCK_SIZE);
+	if (!entry->running) {
+		entry->running = 1;
+		journalRunning++;
+	}
+	return 0;
+}
+
+// Drops a checkpointed block from the table, leaving its contents in the cache. Caller holds cacheLock.
+static void journalRemove(struct journalBlock* entry) {
+	struct journalBlock** link = &journalTable[(unsigned int) entry->blockNum % JOURNAL_BUCKETS];
+	while (*link != entry) {
+		link = &(*link)->hashNext;
+	}
+	*link = entry->hashNext;
+	struct cacheBlock* block = cacheFrameCount > 0 ? cacheLookup(entry->blockNum) : NULL;
+	if (block != NULL) {
+		memcpy(block->data, entry->data, BLOCK_SIZE);
+		block->dirty = 0;
+	}
+	free(entry->committed);
+	free(entry->data);
+	free(entry);
+}
+
+// Copies block_num out of the table if it is there. Caller holds cacheLock.
+static int journalCopy(int block_num, void* buf) {
+	struct journalBlock* entry = journalLength > 0 ? journalLookup(block_num) : NULL;
+	if (entry == NULL) {
+		return 0;
+	}
+	memcpy(buf, entry->data, BLOCK_SIZE);
+	return 1;
+}
+
+static uint32_t journalChecksum(uint32_t checksum, const void* block) {
+	const uint32_t* words = block;
+	for (unsigned int index = 0; index < BLOCK_SIZE / sizeof(uint32_t); index++) {
+		checksum = (checksum ^ words[index]) * 16777619u;
+	}
+	return checksum;
+}
+
+// Log blocks a transaction of count images takes: descriptors, images and the commit block
+static unsigned int journalLogBlocks(unsigned int count) {
+	return count + (count + JOURNAL_DESCRIPTOR_BLOCKS - 1) / JOURNAL_DESCRIPTOR_BLOCKS + 1;
+}
+
+static int diskSync() {
+	if (diskMap != NULL) {
+		return mapSync();
+	}
+	if (diskfile >= 0 && fdatasync(diskfile) < 0) {
+		perror("block_sync failed");
+		return -1;
+	}
+	return 0;
+}
+
+// Writes the journal header; the next sync makes it durable
+static int journalWriteHeader() {
+	struct journal_header* header = NULL;
+	if (posix_memalign((void**) &header, DIRECT_ALIGNMENT, BLOCK_SIZE) != 0) {
+		return -1;
+	}
+	memset(header, 0, BLOCK_SIZE);
+	header->magic = JOURNAL_MAGIC;
+	header->type = JOURNAL_HEADER;
+	header->sequence = journalSequence;
+	void* buf = header;
+	int retstat = ioRuns(1, &journalRegion, &buf, 1);
+	free(header);
+	return retstat;
+}
+
+static int compareJournalBlock(const void* first, const void* second) {
+	int firstBlock = (*(struct journalBlock* const*) first)->blockNum;
+	int secondBlock = (*(struct journalBlock* const*) second)->blockNum;
+	return (firstBlock > secondBlock) - (firstBlock < secondBlock);
+}
+
+/*
+ * Writes the committed version of every logged block in place, syncs, and
+ * empties the log. The new header is synced as well: until it is durable
+ * the old one still describes the log, whose replay would overwrite blocks
+ * freed and reused after the checkpoint. Blocks that did not change since
+ * are dropped from the table. Caller holds journalLock.
+ */
+static int journalCheckpoint() {
+	pthread_mutex_lock(&cacheLock);
+	unsigned int count = 0;
+	for (unsigned int bucket = 0; bucket < JOURNAL_BUCKETS; bucket++) {
+		for (struct journalBlock* entry = journalTable[bucket]; entry != NULL; entry = entry->hashNext) {
+			count += entry->logged;
+		}
+	}
+	struct journalBlock** entries = malloc((count + 1) * sizeof(struct journalBlock*));
+	int* blockNums = malloc((count + 1) * sizeof(int));
+	void** bufs = malloc((count + 1) * sizeof(void*));
+	char* images = NULL;
+	if (entries == NULL || blockNums == NULL || bufs == NULL
+		|| posix_memalign((void**) &images, DIRECT_ALIGNMENT, ((size_t) count + 1) * BLOCK_SIZE) != 0) {
+		pthread_mutex_unlock(&cacheLock);
+		free(entries);
+		free(blockNums);
+		free(bufs);
+		return -1;
+	}
+	count = 0;
+	for (unsigned int bucket = 0; bucket < JOURNAL_BUCKETS; bucket++) {
+		for (struct journalBlock* entry = journalTable[bucket]; entry != NULL; entry = entry->hashNext) {
+			if (entry->logged) {
+				entries[count++] = entry;
+			}
+		}
+	}
+	qsort(entries, count, sizeof(struct journalBlock*), compareJournalBlock);
+	for (unsigned int index = 0; index < count; index++) {
+		blockNums[index] = entries[index]->blockNum;
+		bufs[index] = images + (size_t) index * BLOCK_SIZE;
+		memcpy(bufs[index], entries[index]->committed != NULL ? entries[index]->committed : entries[index]->data, BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&cacheLock);
+	
+	int retstat = count > 0 ? ioRuns(1, blockNums, bufs, count) : 0;
+	if (retstat == 0) {
+		retstat = diskSync();
+	}
+	if (retstat == 0) {
+		pthread_mutex_lock(&cacheLock);
+		for (unsigned int index = 0; index < count; index++) {
+			struct journalBlock* entry = entries[index];
+			entry->logged = 0;
+			free(entry->committed);
+			entry->committed = NULL;
+			if (!entry->running && !entry->snapshotted) {
+				journalRemove(entry);
+			}
+		}
+		// Reads that went to the disk file before this may have seen older blocks
+		writebackGeneration++;
+		cacheStats.journal_checkpoints++;
+		pthread_mutex_unlock(&cacheLock);
+		journalHead = 1;
+		retstat = journalWriteHeader();
+		if (retstat == 0) {
+			retstat = diskSync();
+		}
+	}
+	free(entries);
+	free(blockNums);
+	free(bufs);
+	free(images);
+	return retstat;
+}
+
+/*
+ * Finishes a commit of blocks [first, first + count) of txn: they are now
+ * logged, or running again if it failed
+ */
+static void journalCommitted(struct bio_txn* txn, unsigned int first, unsigned int count, int committed) {
+	pthread_mutex_lock(&cacheLock);
+	for (unsigned int index = first; index < first + count; index++) {
+		struct journalBlock* entry = journalLookup(txn->blockNums[index]);
+		entry->snapshotted = 0;
+		if (!committed) {
+			if (!entry->running) {
+				entry->running = 1;
+				journalRunning++;
+			}
+			continue;
+		}
+		entry->logged = 1;
+		if (entry->running) {
+			// Changed again since the snapshot: the snapshot is its committed version now
+			if (entry->committed == NULL) {
+				entry->committed = malloc(BLOCK_SIZE);
+			}
+			if (entry->committed != NULL) {
+				memcpy(entry->committed, txn->images + (size_t) index * BLOCK_SIZE, BLOCK_SIZE);
+			}
+		} else {
+			free(entry->committed);
+			entry->committed = NULL;
+		}
+	}
+	if (committed && count > 0) {
+		cacheStats.journal_commits++;
+		cacheStats.journal_blocks += count;
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
+
+static void journalFree(struct bio_txn* txn) {
+	free(txn->blockNums);
+	free(txn->images);
+	free(txn);
+}
+
+/*
+ * Starts using blocks [start_block, start_block + blocks) of a freshly made
+ * filesystem as its journal
+ */
+int dev_journal_format(int start_block, int blocks) {
+	pthread_mutex_lock(&journalLock);
+	journalRegion = start_block;
+	journalLength = blocks;
+	journalHead = 1;
+	journalSequence = 1;
+	int retstat = journalWriteHeader();
+	pthread_mutex_unlock(&journalLock);
+	return retstat;
+}
+
+/*
+ * Replays the committed transactions found in the journal at
+ * [start_block, start_block + blocks), then starts using it. Must be called
+ * before any block the journal covers is read. Returns the number of
+ * transactions replayed, or -1 if the journal could not be read.
+ */
+int dev_journal_open(int start_block, int blocks) {
+	char* log = NULL;
+	if (blocks < 2 || posix_memalign((void**) &log, DIRECT_ALIGNMENT, (size_t) blocks * BLOCK_SIZE) != 0) {
+		return -1;
+	}
+	int* logBlocks = malloc(blocks * sizeof(int));
+	void** logBufs = malloc(blocks * sizeof(void*));
+	int* homeBlocks = malloc(blocks * sizeof(int));
+	void** homeBufs = malloc(blocks * sizeof(void*));
+	if (logBlocks == NULL || logBufs == NULL || homeBlocks == NULL || homeBufs == NULL) {
+		free(log);
+		free(logBlocks);
+		free(logBufs);
+		free(homeBlocks);
+		free(homeBufs);
+		return -1;
+	}
+	for (int index = 0; index < blocks; index++) {
+		logBlocks[index] = start_block + index;
+		logBufs[index] = log + (size_t) index * BLOCK_SIZE;
+	}
+	
+	pthread_mutex_lock(&journalLock);
+	int replayed = ioRuns(0, logBlocks, logBufs, blocks) < 0 ? -1 : 0;
+	struct journal_header* header = (struct journal_header*) log;
+	journalRegion = start_block;
+	journalLength = blocks;
+	journalHead = 1;
+	journalSequence = 1;
+	if (replayed == 0 && header->magic == JOURNAL_MAGIC && header->type == JOURNAL_HEADER) {
+		journalSequence = header->sequence;
+	} else if (replayed == 0) {
+		printf("[W-JOURNAL]: No journal header at block %d, starting an empty journal\n", start_block);
+	}
+	unsigned int position = 1;
+	while (replayed >= 0 && header->magic == JOURNAL_MAGIC && position < (unsigned int) blocks) {
+		// Step 1: Collect the descriptors and images of the next transaction
+		uint32_t checksum = JOURNAL_CHECKSUM_SEED;
+		unsigned int count = 0;
+		unsigned int scan = position;
+		while (scan < (unsigned int) blocks) {
+			struct journal_header* descriptor = (struct journal_header*) logBufs[scan];
+			if (descriptor->magic != JOURNAL_MAGIC || descriptor->type != JOURNAL_DESCRIPTOR
+				|| descriptor->sequence != journalSequence || descriptor->count == 0
+				|| descriptor->count > JOURNAL_DESCRIPTOR_BLOCKS || scan + 1 + descriptor->count >= (unsigned int) blocks) {
+				break;
+			}
+			uint32_t* homes = (uint32_t*) (descriptor + 1);
+			checksum = journalChecksum(checksum, descriptor);
+			for (unsigned int index = 0; index < descriptor->count; index++) {
+				homeBlocks[count] = homes[index];
+				homeBufs[count++] = logBufs[scan + 1 + index];
+				checksum = journalChecksum(checksum, logBufs[scan + 1 + index]);
+			}
+			scan += 1 + descriptor->count;
+		}
+		
+		// Step 2: Only a transaction with a matching commit block is applied
+		struct journal_header* commit = scan < (unsigned int) blocks ? (struct journal_header*) logBufs[scan] : NULL;
+		if (count == 0 || commit == NULL || commit->magic != JOURNAL_MAGIC || commit->type != JOURNAL_COMMIT
+			|| commit->sequence != journalSequence || commit->count != count || commit->checksum != checksum) {
+			break;
+		}
+		if (ioRuns(1, homeBlocks, homeBufs, count) < 0) {
+			replayed = -1;
+			break;
+		}
+		pthread_mutex_lock(&cacheLock);
+		for (unsigned int index = 0; index < count; index++) {
+			struct cacheBlock* block = cacheFrameCount > 0 ? cacheLookup(homeBlocks[index]) : NULL;
+			if (block != NULL) {
+				memcpy(block->data, homeBufs[index], BLOCK_SIZE);
+				block->dirty = 0;
+			}
+		}
+		pthread_mutex_unlock(&cacheLock);
+		replayed++;
+		journalSequence++;
+		position = scan + 1;
+	}
+	if (replayed > 0) {
+		printf("[D-JOURNAL]: Replayed %d transactions up to sequence %u\n", replayed, journalSequence - 1);
+		if (diskSync() < 0) {
+			replayed = -1;
+		}
+	}
+	// The replayed log must not be replayed again once blocks get reused
+	if (replayed >= 0 && (journalWriteHeader() < 0 || diskSync() < 0)) {
+		replayed = -1;
+	}
+	pthread_mutex_unlock(&journalLock);
+	free(log);
+	free(logBlocks);
+	free(logBufs);
+	free(homeBlocks);
+	free(homeBufs);
+	return replayed;
+}
+
+/*
+ * Writes a metadata block through the journal: it reaches its home location
+ * only after a commit has logged it. Without a journal this is bio_write().
+ */
+int bio_write_meta(const int block_num, const void *buf) {
+	if (journalLength == 0) {
+		return bio_write(block_num, buf);
+	}
+	pthread_mutex_lock(&cacheLock);
+	int retstat = journalStore(block_num, buf);
+	pthread_mutex_unlock(&cacheLock);
+	return retstat < 0 ? -1 : BLOCK_SIZE;
+}
+
+// Number of journaled blocks changed since the last snapshot
+unsigned int bio_journal_pending() {
+	pthread_mutex_lock(&cacheLock);
+	unsigned int pending = journalRunning;
+	pthread_mutex_unlock(&cacheLock);
+	return pending;
+}
+
+/*
+ * Takes every journaled block changed since the last snapshot as one
+ * transaction, to be passed to bio_journal_commit(). The caller makes sure
+ * no update it wants to be atomic is half done. Returns NULL without a
+ * journal (bio_journal_commit(NULL) then just syncs).
+ */
+struct bio_txn* bio_journal_snapshot() {
+	if (journalLength == 0) {
+		return NULL;
+	}
+	struct bio_txn* txn = calloc(1, sizeof(struct bio_txn));
+	if (txn == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&journalLock);
+	pthread_mutex_lock(&cacheLock);
+	unsigned int count = journalRunning;
+	txn->blockNums = malloc((count + 1) * sizeof(int));
+	if (txn->blockNums == NULL || posix_memalign((void**) &txn->images, DIRECT_ALIGNMENT, ((size_t) count + 1) * BLOCK_SIZE) != 0) {
+		// Nothing is taken; the blocks stay running for the next commit
+		txn->images = NULL;
+		count = 0;
+	}
+	for (unsigned int bucket = 0; bucket < JOURNAL_BUCKETS && txn->count < count; bucket++) {
+		for (struct journalBlock* entry = journalTable[bucket]; entry != NULL; entry = entry->hashNext) {
+			if (!entry->running || txn->count == count) {
+				continue;
+			}
+			memcpy(txn->images + (size_t) txn->count * BLOCK_SIZE, entry->data, BLOCK_SIZE);
+			txn->blockNums[txn->count++] = entry->blockNum;
+			entry->running = 0;
+			entry->snapshotted = 1;
+		}
+	}
+	journalRunning -= txn->count;
+	pthread_mutex_unlock(&cacheLock);
+	return txn;
+}
+
+/*
+ * Appends blocks [first, first + count) of txn to the log at journalHead as
+ * one transaction; its descriptors and commit block are built here. The
+ * caller makes sure the log has room and syncs.
+ */
+static int journalAppend(struct bio_txn* txn, unsigned int first, unsigned int count) {
+	unsigned int descriptors = (count + JOURNAL_DESCRIPTOR_BLOCKS - 1) / JOURNAL_DESCRIPTOR_BLOCKS;
+	unsigned int logCount = journalLogBlocks(count);
+	char* headers = NULL;
+	int* logBlocks = malloc(logCount * sizeof(int));
+	void** logBufs = malloc(logCount * sizeof(void*));
+	if (logBlocks == NULL || logBufs == NULL
+		|| posix_memalign((void**) &headers, DIRECT_ALIGNMENT, ((size_t) descriptors + 1) * BLOCK_SIZE) != 0) {
+		free(logBlocks);
+		free(logBufs);
+		return -1;
+	}
+	memset(headers, 0, ((size_t) descriptors + 1) * BLOCK_SIZE);
+	
+	// Step 1: Each descriptor is followed by the images it lists
+	uint32_t checksum = JOURNAL_CHECKSUM_SEED;
+	unsigned int position = 0;
+	for (unsigned int group = 0; group < descriptors; group++) {
+		struct journal_header* descriptor = (struct journal_header*) (headers + (size_t) group * BLOCK_SIZE);
+		unsigned int groupFirst = first + group * JOURNAL_DESCRIPTOR_BLOCKS;
+		unsigned int remaining = first + count - groupFirst;
+		descriptor->magic = JOURNAL_MAGIC;
+		descriptor->type = JOURNAL_DESCRIPTOR;
+		descriptor->sequence = journalSequence;
+		descriptor->count = remaining < JOURNAL_DESCRIPTOR_BLOCKS ? remaining : JOURNAL_DESCRIPTOR_BLOCKS;
+		uint32_t* homes = (uint32_t*) (descriptor + 1);
+		for (unsigned int index = 0; index < descriptor->count; index++) {
+			homes[index] = txn->blockNums[groupFirst + index];
+		}
+		checksum = journalChecksum(checksum, descriptor);
+		logBufs[position++] = descriptor;
+		for (unsigned int index = 0; index < descriptor->count; index++) {
+			char* image = txn->images + (size_t) (groupFirst + index) * BLOCK_SIZE;
+			checksum = journalChecksum(checksum, image);
+			logBufs[position++] = image;
+		}
+	}
+	
+	// Step 2: The commit block closes the transaction
+	struct journal_header* commit = (struct journal_header*) (headers + (size_t) descriptors * BLOCK_SIZE);
+	commit->magic = JOURNAL_MAGIC;
+	commit->type = JOURNAL_COMMIT;
+	commit->sequence = journalSequence;
+	commit->count = count;
+	commit->checksum = checksum;
+	logBufs[position++] = commit;
+	
+	for (unsigned int index = 0; index < logCount; index++) {
+		logBlocks[index] = journalRegion + journalHead + index;
+	}
+	int retstat = ioRuns(1, logBlocks, logBufs, logCount);
+	free(logBlocks);
+	free(logBufs);
+	free(headers);
+	return retstat;
+}
+
+/*
+ * Commits txn from bio_journal_snapshot(): writes the dirty buffer cache
+ * blocks and the transaction to the log, then issues one fdatasync for
+ * both. A transaction the log cannot hold is committed as several smaller
+ * ones, each synced and atomic on its own, checkpointing in between as the
+ * log fills; its blocks never bypass the log. Returns 0, or -1 if a write
+ * or the sync failed (the blocks not committed are then logged again by
+ * the next commit).
+ */
+int bio_journal_commit(struct bio_txn* txn) {
+	if (txn == NULL) {
+		return bio_sync();
+	}
+	int retstat = bio_flush();
+	
+	// The most images one transaction can take in an empty log (block 0 is the header)
+	unsigned int maxCount = 0;
+	while (journalLogBlocks(maxCount + 1) <= journalLength - 1) {
+		maxCount++;
+	}
+	if (txn->count > maxCount && maxCount > 0) {
+		printf("[W-JOURNAL]: A transaction of %u blocks does not fit in the journal, committing it in %u parts\n",
+			txn->count, (txn->count + maxCount - 1) / maxCount);
+	}
+	unsigned int first = 0;
+	do {
+		unsigned int count = txn->count - first < maxCount ? txn->count - first : maxCount;
+		if (retstat == 0 && count == 0 && first < txn->count) {
+			printf("[E-JOURNAL]: The journal is too small to log any block\n");
+			retstat = -1;
+		}
+		if (retstat == 0 && count > 0 && journalHead + journalLogBlocks(count) > journalLength) {
+			retstat = journalCheckpoint();
+		}
+		if (retstat == 0 && count > 0) {
+			retstat = journalAppend(txn, first, count);
+		}
+		
+		// One sync makes the data and the transaction durable
+		if (retstat == 0) {
+			retstat = diskSync();
+		}
+		if (retstat < 0) {
+			break;
+		}
+		journalCommitted(txn, first, count, 1);
+		if (count > 0) {
+			journalHead += journalLogBlocks(count);
+			journalSequence++;
+		}
+		first += count;
+	} while (first < txn->count);
+	journalCommitted(txn, first, txn->count - first, 0);
+	
+	if (retstat == 0 && txn->count > 0 && journalHead > journalLength / 2) {
+		retstat = journalCheckpoint();
+	}
+	journalFree(txn);
+	pthread_mutex_unlock(&journalLock);
+	return retstat;
+}
+
+// Commits and checkpoints whatever is left, then stops journaling. The
+// checkpoint syncs the header of the emptied log, so none is replayed.
+static void journalClose() {
+	if (journalLength == 0) {
+		return;
+	}
+	bio_journal_commit(bio_journal_snapshot());
+	pthread_mutex_lock(&journalLock);
+	journalCheckpoint();
+	pthread_mutex_lock(&cacheLock);
+	for (unsigned int bucket = 0; bucket < JOURNAL_BUCKETS; bucket++) {
+		while (journalTable[bucket] != NULL) {
+			journalRemove(journalTable[bucket]);
+		}
+	}
+	journalRunning = 0;
+	journalLength = 0;
+	pthread_mutex_unlock(&cacheLock);
+	pthread_mutex_unlock(&journalLock);
+}
+
+/*
+ * Selects the I/O backend (BIO_BACKEND_*) and how many requests it may have
+ * in flight. Takes effect at the next dev_init()/dev_open().
+ */
+int dev_set_backend(int backend, unsigned int queue_depth) {
+	if (backend != BIO_BACKEND_SYNC && backend != BIO_BACKEND_URING && backend != BIO_BACKEND_THREADS
+		&& backend != BIO_BACKEND_MMAP) {
+		return -1;
+	}
+	ioBackend = backend;
+	ioQueueDepth = queue_depth > 0 ? queue_depth : DEFAULT_QUEUE_DEPTH;
+	return 0;
+}
+
+/*
+ * Opens the disk file with O_DIRECT (if direct is set) at the next
+ * dev_init()/dev_open(), bypassing the host page cache.
+ */
+void dev_set_direct(int direct) {
+	directRequested = direct;
+}
+
+// Name of the backend in use (after any fallback)
+const char* dev_backend_name() {
+	if (ioActiveBackend == BIO_BACKEND_URING) {
+		return "uring";
+	}
+	if (ioActiveBackend == BIO_BACKEND_MMAP) {
+		return "mmap";
+	}
+	return ioActiveBackend == BIO_BACKEND_THREADS ? "threads" : "sync";
+}
+
+/*
+ * Sets up a buffer cache of cache_bytes (rounded down to whole blocks).
+ * Must be called before dev_init()/dev_open(); a budget of 0 disables the cache.
+ */
+int dev_cache_init(size_t cache_bytes) {
+	dev_cache_destroy();
+	memset(&cacheStats, 0, sizeof(cacheStats));
+	cacheFrameCount = cache_bytes / BLOCK_SIZE;
+	if (cacheFrameCount == 0) {
+		return 0;
+	}
+	
+	cacheFrames = calloc(cacheFrameCount, sizeof(struct cacheBlock));
+	// Aligned so O_DIRECT reads and write-backs need no bounce buffer
+	if (posix_memalign((void**) &cacheData, DIRECT_ALIGNMENT, (size_t) cacheFrameCount * BLOCK_SIZE) != 0) {
+		cacheData = NULL;
+	}
+	cacheBuckets = calloc(cacheFrameCount, sizeof(struct cacheBlock*));
+	ghostTarget = (cacheFrameCount * CACHE_A1OUT_PERCENT) / 100;
+	ghostEntries = calloc(ghostTarget + 1, sizeof(struct ghostBlock));
+	ghostBuckets = calloc(cacheFrameCount, sizeof(struct ghostBlock*));
+	if (cacheFrames == NULL || cacheData == NULL || cacheBuckets == NULL || ghostEntries == NULL || ghostBuckets == NULL) {
+		perror("dev_cache_init failed");
+		dev_cache_destroy();
+		return -1;
+	}
+	
+	a1inTarget = (cacheFrameCount * CACHE_A1IN_PERCENT) / 100;
+	if (a1inTarget == 0) {
+		a1inTarget = 1;
+	}
+	listInit(&freeList);
+	listInit(&a1inList);
+	listInit(&amList);
+	ghostList.next = &ghostList;
+	ghostList.prev = &ghostList;
+	ghostCount = 0;
+	ghostFree = NULL;
+	for (unsigned int ghostIndex = 0; ghostIndex < ghostTarget; ghostIndex++) {
+		ghostEntries[ghostIndex].hashNext = ghostFree;
+		ghostFree = &ghostEntries[ghostIndex];
+	}
+	for (unsigned int frameIndex = 0; frameIndex < cacheFrameCount; frameIndex++) {
+		cacheFrames[frameIndex].data = cacheData + ((size_t) frameIndex * BLOCK_SIZE);
+		listPushFront(&freeList, &cacheFrames[frameIndex]);
+	}
+	return 0;
+}
+
+// Drops every cached block without writing it back (see bio_flush())
+void dev_cache_destroy() {
+	prefetchWait();
+	free(cacheFrames);
+	free(cacheData);
+	free(cacheBuckets);
+	free(ghostEntries);
+	free(ghostBuckets);
+	cacheFrames = NULL;
+	cacheData = NULL;
+	cacheBuckets = NULL;
+	ghostEntries = NULL;
+	ghostBuckets = NULL;
+	cacheFrameCount = 0;
+	ghostTarget = 0;
+	ghostFree = NULL;
+}
+
+void bio_get_stats(struct bio_cache_stats* stats) {
+	pthread_mutex_lock(&cacheLock);
+	*stats = cacheStats;
+	stats->cached_blocks = cacheFrameCount == 0 ? 0 : a1inList.count + amList.count;
+	stats->capacity_blocks = cacheFrameCount;
+	pthread_mutex_unlock(&cacheLock);
+	stats->disk_reads = __atomic_load_n(&diskReads, __ATOMIC_RELAXED);
+	stats->disk_writes = __atomic_load_n(&diskWrites, __ATOMIC_RELAXED);
+	stats->direct_io = diskDirect;
+}
+
+static int compareBlockNum(const void* first, const void* second) {
+	int firstBlock = (*(struct cacheBlock* const*) first)->blockNum;
+	int secondBlock = (*(struct cacheBlock* const*) second)->blockNum;
+	return (firstBlock > secondBlock) - (firstBlock < secondBlock);
+}
+
+// Writes every dirty cached block to the disk file, in block order
+int bio_flush() {
+	if (cacheFrameCount == 0) {
+		return 0;
+	}
+	struct cacheBlock** dirtyBlocks = malloc(cacheFrameCount * sizeof(struct cacheBlock*));
+	if (dirtyBlocks == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&cacheLock);
+	unsigned int dirtyCount = 0;
+	for (unsigned int frameIndex = 0; frameIndex < cacheFrameCount; frameIndex++) {
+		if (cacheFrames[frameIndex].valid && cacheFrames[frameIndex].dirty) {
+			dirtyBlocks[dirtyCount++] = &cacheFrames[frameIndex];
+		}
+	}
+	qsort(dirtyBlocks, dirtyCount, sizeof(struct cacheBlock*), compareBlockNum);
+	
+	// Adjacent dirty blocks go out as single writes, all in one batch
+	int* blockNums = malloc(dirtyCount * sizeof(int));
+	void** bufs = malloc(dirtyCount * sizeof(void*));
+	int retstat = 0;
+	if (dirtyCount > 0 && (blockNums == NULL || bufs == NULL)) {
+		retstat = -1;
+	} else if (dirtyCount > 0) {
+		for (unsigned int dirtyIndex = 0; dirtyIndex < dirtyCount; dirtyIndex++) {
+			blockNums[dirtyIndex] = dirtyBlocks[dirtyIndex]->blockNum;
+			bufs[dirtyIndex] = dirtyBlocks[dirtyIndex]->data;
+		}
+		retstat = ioRuns(1, blockNums, bufs, dirtyCount);
+		if (retstat == 0) {
+			for (unsigned int dirtyIndex = 0; dirtyIndex < dirtyCount; dirtyIndex++) {
+				dirtyBlocks[dirtyIndex]->dirty = 0;
+			}
+			cacheStats.writebacks += dirtyCount;
+			writebackGeneration++;
+		}
+	}
+	pthread_mutex_unlock(&cacheLock);
+	free(blockNums);
+	free(bufs);
+	free(dirtyBlocks);
+	return retstat;
+}
+
+// bio_flush() followed by fdatasync() of the disk file
+int bio_sync() {
+	int retstat = bio_flush();
+	if (diskSync() < 0) {
+		retstat = -1;
+	}
+	return retstat;
+}
+
+/*
+ * With the mmap backend, returns a pointer to block_num in the mapping for
+ * reading in place, or NULL when the caller has to bio_read() it instead
+ * (another backend, or the buffer cache holds a newer copy). The block is
+ * only valid for as long as the caller keeps writers of it out.
+ */
+const void* bio_peek(const int block_num) {
+	if (diskMap == NULL || block_num < 0 || (size_t) block_num >= diskSize / BLOCK_SIZE) {
+		return NULL;
+	}
+	if (cacheFrameCount > 0 || journalLength > 0) {
+		pthread_mutex_lock(&cacheLock);
+		struct cacheBlock* block = cacheFrameCount > 0 ? cacheLookup(block_num) : NULL;
+		int dirty = (block != NULL && block->dirty) || (journalLength > 0 && journalLookup(block_num) != NULL);
+		pthread_mutex_unlock(&cacheLock);
+		if (dirty) {
+			return NULL;
+		}
+	}
+	return diskMap + (size_t) block_num * BLOCK_SIZE;
 }
 
 //Read a block from the disk
 int bio_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat <= 0) {
-		memset (buf, 0, BLOCK_SIZE);
-		if (retstat < 0)
-			perror("block_read failed");
+    if (cacheFrameCount == 0) {
+		if (journalLength > 0) {
+			pthread_mutex_lock(&cacheLock);
+			int journaled = journalCopy(block_num, buf);
+			pthread_mutex_unlock(&cacheLock);
+			if (journaled) {
+				return BLOCK_SIZE;
+			}
+		}
+		return ioRuns(0, &block_num, &buf, 1) < 0 ? -1 : BLOCK_SIZE;
     }
-
+    
+    pthread_mutex_lock(&cacheLock);
+    prefetchInstall();
+    if (journalCopy(block_num, buf)) {
+		cacheStats.hits++;
+		pthread_mutex_unlock(&cacheLock);
+		return BLOCK_SIZE;
+    }
+    struct cacheBlock* block = cacheLookup(block_num);
+    if (block != NULL) {
+		cacheStats.hits++;
+		cacheTouch(block);
+		memcpy(buf, block->data, BLOCK_SIZE);
+		pthread_mutex_unlock(&cacheLock);
+		return BLOCK_SIZE;
+    }
+    cacheStats.misses++;
+    
+    while (1) {
+		unsigned long generation = writebackGeneration;
+		pthread_mutex_unlock(&cacheLock);
+		if (ioRuns(0, &block_num, &buf, 1) < 0) {
+			return -1;
+		}
+		retstat = BLOCK_SIZE;
+		pthread_mutex_lock(&cacheLock);
+		
+		// Another thread may have cached (and possibly written) the block meanwhile
+		if (journalCopy(block_num, buf)) {
+			break;
+		}
+		block = cacheLookup(block_num);
+		if (block != NULL) {
+			memcpy(buf, block->data, BLOCK_SIZE);
+			break;
+		}
+		if (generation == writebackGeneration) {
+			block = cacheInsert(block_num);
+			if (block != NULL) {
+				memcpy(block->data, buf, BLOCK_SIZE);
+			}
+			break;
+		}
+    }
+    pthread_mutex_unlock(&cacheLock);
     return retstat;
 }
 
 //Write a block to the disk
 int bio_write(const int block_num, const void *buf) {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat < 0) {
-		    perror("block_write failed");
+    if (cacheFrameCount > 0 || journalLength > 0) {
+		// A block the journal holds stays journaled until it is checkpointed
+		pthread_mutex_lock(&cacheLock);
+		if (journalLength > 0 && journalLookup(block_num) != NULL) {
+			retstat = journalStore(block_num, buf);
+			pthread_mutex_unlock(&cacheLock);
+			return retstat < 0 ? -1 : BLOCK_SIZE;
+		}
+		if (cacheFrameCount > 0) {
+			struct cacheBlock* block = cacheLookup(block_num);
+			if (block != NULL) {
+				cacheTouch(block);
+			} else {
+				block = cacheInsert(block_num);
+			}
+			if (block == NULL) {
+				// No frame could be freed, so the block is written in place;
+				// a read miss that already read the old copy must not cache it
+				writebackGeneration++;
+				void* data = (void*) buf;
+				retstat = ioRuns(1, &block_num, &data, 1);
+				pthread_mutex_unlock(&cacheLock);
+				return retstat < 0 ? retstat : BLOCK_SIZE;
+			}
+			memcpy(block->data, buf, BLOCK_SIZE);
+			block->dirty = 1;
+			pthread_mutex_unlock(&cacheLock);
+			return BLOCK_SIZE;
+		}
+		pthread_mutex_unlock(&cacheLock);
     }
-    return retstat;
+    
+    void* data = (void*) buf;
+    retstat = ioRuns(1, &block_num, &data, 1);
+    return retstat < 0 ? retstat : BLOCK_SIZE;
+}
+
+/*
+ * Reads block_nums[i] into bufs[i] for count blocks. Cached blocks are
+ * copied, the rest is read with one preadv per run of consecutive block
+ * numbers. Returns count * BLOCK_SIZE, or -1 if a read failed.
+ */
+int bio_readv(const int* block_nums, void* const* bufs, int count) {
+	if (count <= 0) {
+		return 0;
+	}
+	int retstat = count * BLOCK_SIZE;
+	if (cacheFrameCount == 0 && journalLength == 0) {
+		return ioRuns(0, block_nums, bufs, count) < 0 ? -1 : retstat;
+	}
+	
+	int* missing = malloc(count * sizeof(int));
+	int* missingBlocks = malloc(count * sizeof(int));
+	void** missingBufs = malloc(count * sizeof(void*));
+	if (missing == NULL || missingBlocks == NULL || missingBufs == NULL) {
+		free(missing);
+		free(missingBlocks);
+		free(missingBufs);
+		return -1;
+	}
+	int missingCount = 0;
+	pthread_mutex_lock(&cacheLock);
+	prefetchInstall();
+	for (int index = 0; index < count; index++) {
+		struct cacheBlock* block = NULL;
+		if (journalCopy(block_nums[index], bufs[index])) {
+			cacheStats.hits++;
+		} else if (cacheFrameCount == 0) {
+			missing[missingCount++] = index;
+		} else if ((block = cacheLookup(block_nums[index])) != NULL) {
+			cacheStats.hits++;
+			cacheTouch(block);
+			memcpy(bufs[index], block->data, BLOCK_SIZE);
+		} else {
+			cacheStats.misses++;
+			missing[missingCount++] = index;
+		}
+	}
+	
+	// Same protocol as a bio_read() miss, for all missing blocks at once
+	while (missingCount > 0) {
+		unsigned long generation = writebackGeneration;
+		pthread_mutex_unlock(&cacheLock);
+		for (int missingIndex = 0; missingIndex < missingCount; missingIndex++) {
+			missingBlocks[missingIndex] = block_nums[missing[missingIndex]];
+			missingBufs[missingIndex] = bufs[missing[missingIndex]];
+		}
+		if (ioRuns(0, missingBlocks, missingBufs, missingCount) < 0) {
+			retstat = -1;
+		}
+		pthread_mutex_lock(&cacheLock);
+		if (cacheFrameCount == 0) {
+			break;
+		}
+		
+		int stillMissing = 0;
+		for (int missingIndex = 0; missingIndex < missingCount; missingIndex++) {
+			int index = missing[missingIndex];
+			struct cacheBlock* block = cacheLookup(block_nums[index]);
+			if (journalCopy(block_nums[index], bufs[index])) {
+				continue;
+			}
+			if (block != NULL) {
+				memcpy(bufs[index], block->data, BLOCK_SIZE);
+			} else if (generation == writebackGeneration && retstat >= 0) {
+				block = cacheInsert(block_nums[index]);
+				if (block != NULL) {
+					memcpy(block->data, bufs[index], BLOCK_SIZE);
+				}
+			} else if (retstat >= 0) {
+				missing[stillMissing++] = index;
+			}
+		}
+		missingCount = stillMissing;
+	}
+	pthread_mutex_unlock(&cacheLock);
+	free(missing);
+	free(missingBlocks);
+	free(missingBufs);
+	return retstat;
+}
+
+/*
+ * Writes bufs[i] to block_nums[i] for count blocks. With the cache this only
+ * dirties cached copies; without it each run of consecutive block numbers
+ * is one pwritev. Returns count * BLOCK_SIZE, or -1 if a write failed.
+ */
+int bio_writev(const int* block_nums, const void* const* bufs, int count) {
+	if (count <= 0) {
+		return 0;
+	}
+	int retstat = count * BLOCK_SIZE;
+	if (cacheFrameCount > 0) {
+		pthread_mutex_lock(&cacheLock);
+		for (int index = 0; index < count; index++) {
+			if (journalLength > 0 && journalLookup(block_nums[index]) != NULL) {
+				if (journalStore(block_nums[index], bufs[index]) < 0) {
+					retstat = -1;
+				}
+				continue;
+			}
+			struct cacheBlock* block = cacheLookup(block_nums[index]);
+			if (block != NULL) {
+				cacheTouch(block);
+			} else {
+				block = cacheInsert(block_nums[index]);
+			}
+			if (block == NULL) {
+				// No frame could be freed, so the block is written in place
+				writebackGeneration++;
+				void* data = (void*) bufs[index];
+				if (ioRuns(1, &block_nums[index], &data, 1) < 0) {
+					retstat = -1;
+				}
+				continue;
+			}
+			memcpy(block->data, bufs[index], BLOCK_SIZE);
+			block->dirty = 1;
+		}
+		pthread_mutex_unlock(&cacheLock);
+		return retstat;
+	}
+	if (journalLength == 0) {
+		return ioRuns(1, block_nums, (void* const*) bufs, count) < 0 ? -1 : retstat;
+	}
+	
+	// Blocks the journal holds are stored there, the rest is written in place
+	int* inPlaceBlocks = malloc(count * sizeof(int));
+	void** inPlaceBufs = malloc(count * sizeof(void*));
+	if (inPlaceBlocks == NULL || inPlaceBufs == NULL) {
+		free(inPlaceBlocks);
+		free(inPlaceBufs);
+		return -1;
+	}
+	int inPlaceCount = 0;
+	pthread_mutex_lock(&cacheLock);
+	for (int index = 0; index < count; index++) {
+		if (journalLookup(block_nums[index]) == NULL) {
+			inPlaceBlocks[inPlaceCount] = block_nums[index];
+			inPlaceBufs[inPlaceCount++] = (void*) bufs[index];
+		} else if (journalStore(block_nums[index], bufs[index]) < 0) {
+			retstat = -1;
+		}
+	}
+	pthread_mutex_unlock(&cacheLock);
+	if (inPlaceCount > 0 && ioRuns(1, inPlaceBlocks, inPlaceBufs, inPlaceCount) < 0) {
+		retstat = -1;
+	}
+	free(inPlaceBlocks);
+	free(inPlaceBufs);
+	return retstat;
+}
+
+/*
+ * Starts reading the blocks in block_nums that are not cached yet into the
+ * cache, and returns without waiting for them. At most a quarter of the
+ * cache is read ahead per call. With the sync backend the read happens
+ * before this returns. Returns how many blocks were requested.
+ */
+int bio_prefetch(const int* block_nums, int count) {
+	if (cacheFrameCount == 0 || diskfile < 0 || count <= 0) {
+		return 0;
+	}
+	if (count > (int) (cacheFrameCount / 4)) {
+		count = cacheFrameCount / 4;
+	}
+	struct prefetch* prefetch = calloc(1, sizeof(struct prefetch));
+	if (prefetch == NULL) {
+		return 0;
+	}
+	prefetch->blockNums = malloc(count * sizeof(int));
+	prefetch->requests = malloc(count * sizeof(struct ioRequest));
+	prefetch->iov = malloc(count * sizeof(struct iovec));
+	if (prefetch->blockNums == NULL || prefetch->requests == NULL || prefetch->iov == NULL
+		|| posix_memalign((void**) &prefetch->data, DIRECT_ALIGNMENT, (size_t) count * BLOCK_SIZE) != 0) {
+		prefetch->data = NULL;
+		prefetchFree(prefetch);
+		return 0;
+	}
+	
+	pthread_mutex_lock(&cacheLock);
+	prefetchInstall();
+	for (int index = 0; index < count; index++) {
+		if (block_nums[index] > 0 && cacheLookup(block_nums[index]) == NULL) {
+			prefetch->blockNums[prefetch->count++] = block_nums[index];
+		}
+	}
+	prefetch->generation = writebackGeneration;
+	pthread_mutex_unlock(&cacheLock);
+	if (prefetch->count == 0) {
+		prefetchFree(prefetch);
+		return 0;
+	}
+	
+	int runs = 0;
+	for (int first = 0; first < prefetch->count; ) {
+		int length = runLength(prefetch->blockNums, first, prefetch->count);
+		for (int index = first; index < first + length; index++) {
+			prefetch->iov[index].iov_base = prefetch->data + (size_t) index * BLOCK_SIZE;
+			prefetch->iov[index].iov_len = BLOCK_SIZE;
+		}
+		struct ioRequest* request = &prefetch->requests[runs++];
+		request->write = 0;
+		request->blockNum = prefetch->blockNums[first];
+		request->iov = prefetch->iov + first;
+		request->iovcnt = length;
+		request->done = prefetchRequestDone;
+		request->arg = prefetch;
+		first += length;
+	}
+	int requested = prefetch->count;
+	prefetch->pending = runs;
+	struct ioRequest* stackPointers[IO_STACK_BLOCKS];
+	struct ioRequest** pointers = runs <= IO_STACK_BLOCKS ? stackPointers : malloc(runs * sizeof(struct ioRequest*));
+	if (pointers == NULL) {
+		prefetchFree(prefetch);
+		return 0;
+	}
+	for (int run = 0; run < runs; run++) {
+		pointers[run] = &prefetch->requests[run];
+	}
+	pthread_mutex_lock(&prefetchLock);
+	prefetchInFlight++;
+	pthread_mutex_unlock(&prefetchLock);
+	ioSubmit(pointers, runs);
+	if (pointers != stackPointers) {
+		free(pointers);
+	}
+	return requested;
+}
+
+// Reads count consecutive blocks starting at block_num into buf
+int bio_read_range(const int block_num, int count, void *buf) {
+	int block_nums[count];
+	void* bufs[count];
+	for (int index = 0; index < count; index++) {
+		block_nums[index] = block_num + index;
+		bufs[index] = (char*) buf + ((size_t) index * BLOCK_SIZE);
+	}
+	return bio_readv(block_nums, bufs, count);
+}
+
+// Writes count consecutive blocks starting at block_num from buf
+int bio_write_range(const int block_num, int count, const void *buf) {
+	int block_nums[count];
+	const void* bufs[count];
+	for (int index = 0; index < count; index++) {
+		block_nums[index] = block_num + index;
+		bufs[index] = (const char*) buf + ((size_t) index * BLOCK_SIZE);
+	}
+	return bio_writev(block_nums, bufs, count);
 }
 
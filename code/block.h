@@ -8,15 +8,89 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define BLOCK_SIZE 4096
 
-//Disk size set to 32MB
-#define DISK_SIZE 32*1024*1024
+//Size of a disk file made without a size (mkfs.tfs -s, -o disk_mb=), 32MB
+#define DEFAULT_DISK_SIZE (32*1024*1024)
+
+//Default buffer cache budget, can be changed at mount time
+#define DEFAULT_CACHE_SIZE (8*1024*1024)
+
+//I/O backends for the disk file (see dev_set_backend())
+#define BIO_BACKEND_SYNC (0)
+#define BIO_BACKEND_URING (1)
+#define BIO_BACKEND_THREADS (2)
+#define BIO_BACKEND_MMAP (3)
+#define DEFAULT_QUEUE_DEPTH (32)
+
+struct bio_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long writebacks;
+	unsigned long cached_blocks;
+	unsigned long capacity_blocks;
+	unsigned long disk_reads;		/* reads issued to the disk file */
+	unsigned long disk_writes;		/* writes issued to the disk file */
+	unsigned long prefetched;		/* blocks bio_prefetch() brought into the cache */
+	int direct_io;					/* disk file is open with O_DIRECT */
+	unsigned long journal_commits;	/* transactions committed to the journal */
+	unsigned long journal_blocks;	/* metadata blocks logged by those commits */
+	unsigned long journal_checkpoints;	/* times the log was written back and emptied */
+};
+
+/*
+ * Metadata journal format (see dev_journal_open()). The first block of the
+ * journal region is a JOURNAL_HEADER holding the sequence number of the
+ * transaction the log (the rest of the region) starts with. A transaction
+ * is one or more JOURNAL_DESCRIPTOR blocks, each followed by the images of
+ * the blocks it lists, and a JOURNAL_COMMIT block whose checksum covers the
+ * descriptors and images. Replay stops at the first incomplete transaction.
+ */
+#define JOURNAL_MAGIC (0x4A524E4C)
+#define JOURNAL_HEADER (1)
+#define JOURNAL_DESCRIPTOR (2)
+#define JOURNAL_COMMIT (3)
+
+struct journal_header {
+	uint32_t magic;
+	uint32_t type;					/* JOURNAL_HEADER, JOURNAL_DESCRIPTOR or JOURNAL_COMMIT */
+	uint32_t sequence;				/* transaction the block belongs to */
+	uint32_t count;					/* blocks listed (descriptor) or logged (commit) */
+	uint32_t checksum;				/* checksum of the transaction (commit) */
+};
+// A descriptor block is a journal_header followed by the home block numbers
+#define JOURNAL_DESCRIPTOR_BLOCKS ((BLOCK_SIZE - sizeof(struct journal_header)) / sizeof(uint32_t))
+
+struct bio_txn;
 
-void dev_init(const char* diskfile_path);
+void dev_init(const char* diskfile_path, size_t size);
 int dev_open(const char* diskfile_path);
 void dev_close();
+int dev_set_backend(int backend, unsigned int queue_depth);
+void dev_set_direct(int direct);
+const char* dev_backend_name();
+int dev_cache_init(size_t cache_bytes);
+void dev_cache_destroy();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_readv(const int* block_nums, void* const* bufs, int count);
+int bio_writev(const int* block_nums, const void* const* bufs, int count);
+int bio_prefetch(const int* block_nums, int count);
+int bio_read_range(const int block_num, int count, void *buf);
+int bio_write_range(const int block_num, int count, const void *buf);
+int bio_flush();
+int bio_sync();
+const void* bio_peek(const int block_num);
+int dev_journal_format(int start_block, int blocks);
+int dev_journal_open(int start_block, int blocks);
+int bio_write_meta(const int block_num, const void *buf);
+unsigned int bio_journal_pending();
+struct bio_txn* bio_journal_snapshot();
+int bio_journal_commit(struct bio_txn* txn);
+void bio_get_stats(struct bio_cache_stats* stats);
 
 #endif
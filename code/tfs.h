@@ -10,43 +10,169 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "block.h"
+
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024 // This is the maximum number of inode (not max ino number)
-#define MAX_DNUM 16384 // This is the maximum number of data blocks (not max data block number)
-#define MAX_DIRECT_POINTERS (16)
+#define MAGIC_NUM 0x5C40 // 0x5C3F directory blocks had no dir_summary
+#define DEFAULT_INODES 1024 // Inodes of a filesystem made without -i/inodes=
+#define MAX_INODES (1 << 24) // Mount keeps only the inode bitmap per inode (2 MB at this size)
+#define MAX_DIRECT_POINTERS (10)
 #define MAX_INDIRECT_POINTERS (8)
 
+#define TFS_FEATURE_EXTENTS (0x1) // regular files map their data with extent trees
+#define TFS_FEATURE_JOURNAL (0x2) // metadata updates go through the journal region
+
+/*
+ * Geometry is chosen at mkfs. Each bitmap spans as many blocks as its bit
+ * count needs; blocks is 64 bits wide, the block numbers stored in inodes
+ * and bitmaps are 32.
+ */
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
-	uint16_t	max_inum;			/* maximum inode number */
-	uint16_t	max_dnum;			/* maximum data block number */
+	uint32_t	block_size;			/* bytes per block, must be BLOCK_SIZE */
+	uint64_t	blocks;				/* blocks on the disk */
+	uint32_t	max_inum;			/* maximum inode number */
+	uint32_t	max_dnum;			/* maximum data block number */
 	uint32_t	i_bitmap_blk;		/* start block of inode bitmap */
+	uint32_t	i_bitmap_blocks;	/* blocks in the inode bitmap */
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
+	uint32_t	d_bitmap_blocks;	/* blocks in the data block bitmap */
 	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	features;			/* TFS_FEATURE_* flags chosen at mkfs */
+	uint32_t	j_start_blk;		/* start block of the journal (TFS_FEATURE_JOURNAL) */
+	uint32_t	j_blocks;			/* blocks in the journal */
+	uint32_t	inode_size;			/* bytes per on-disk inode, sizeof(struct inode) */
 };
 
+/*
+ * On-disk inode, 128 bytes so 32 fit a block. The cache keeps the same
+ * layout in memory; struct stat is synthesized from it by fillStat. Times
+ * are nanoseconds since the epoch. version is INODE_VERSION when the inode
+ * was written and lets later formats convert older inodes as they load.
+ * A file or symlink whose contents fit the pointer area keeps them there
+ * (INODE_INLINE_DATA) and owns no data blocks.
+ */
+#define INODE_VERSION 1
+#define INODE_INLINE_DATA (0x1) // file data or symlink target is held in the pointer area
+#define INLINE_DATA_SIZE (sizeof(int) * (MAX_DIRECT_POINTERS + MAX_INDIRECT_POINTERS))
+
 struct inode {
-	uint16_t	ino;				/* inode number */
-	uint16_t	valid;				/* validity of the inode */
-	uint32_t	size;				/* size of the file */
-	uint32_t	type;				/* type of the file */
+	uint32_t	ino;				/* inode number */
+	uint8_t		valid;				/* validity of the inode */
+	uint8_t		version;			/* INODE_VERSION */
+	uint16_t	type;				/* type of the file */
+	uint16_t	mode;				/* S_IFMT and permission bits */
+	uint16_t	flags;				/* INODE_* flags */
 	uint32_t	link;				/* link count */
+	uint32_t	uid;				/* owner */
+	uint32_t	gid;				/* group */
+	uint32_t	size;				/* size of the file */
+	uint32_t	blocks;				/* blocks held, mapping blocks included */
+	uint64_t	atime;				/* last access */
+	uint64_t	mtime;				/* last modification */
+	uint64_t	ctime;				/* last change */
 	int			direct_ptr[MAX_DIRECT_POINTERS];		/* direct pointer to data block */
 	int			indirect_ptr[MAX_INDIRECT_POINTERS];	/* indirect pointer to data block */
-	struct stat	vstat;				/* inode stat */
 };
 
+/*
+ * Directory blocks start with a dir_summary followed by variable length
+ * records, like ext2: a dir_record header followed by the name (not null
+ * terminated), padded to 4 bytes. rec_len chains the records through the
+ * block up to DX_TAIL_OFFSET, so a record can be followed by slack a new
+ * entry may be carved from. Removing an entry folds its record into the one
+ * before it; an unused first record has name_len 0. hash caches nameHash()
+ * of the name so lookups compare names only for records whose hash
+ * matches, and the hashed index never rehashes a block it splits.
+ */
+#define DIR_SUMMARY_BYTES (64)
+
+// Bloom filter of the hashes of a block's names, one cache line, so a
+// lookup skips blocks without the name before touching their records
+struct dir_summary {
+	uint8_t		bits[DIR_SUMMARY_BYTES];	/* two bits set per name hash */
+};
+
+struct dir_record {
+	uint32_t	hash;				/* nameHash() of name, 0 if unused */
+	uint32_t	ino;				/* inode number of the entry */
+	uint16_t	rec_len;			/* bytes from this record to the next one */
+	uint16_t	name_len;			/* length of name, 0 if unused */
+	char		name[];				/* name_len bytes */
+};
+
+// A directory entry as handed around in memory, decoded from its dir_record
 struct dirent {
-	uint16_t ino;					/* inode number of the directory entry */
+	uint32_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
 	char name[208];					/* name of the directory entry */
 	uint16_t len;					/* length of name */
 };
 
+/*
+ * Hashed directory index. The record chain of a directory block stops
+ * sizeof(struct dx_tail) bytes short of its end. In the first block of an
+ * indexed directory (direct_ptr[0]) that space holds a dx_tail pointing at the
+ * root of a tree of dx_nodes. Each dx_entry maps the name hashes from its hash
+ * up to the next entry's hash to a block one level down; level 0 entries point
+ * at ordinary directory blocks, so directories without a dx_tail are plain
+ * linear directories.
+ */
+#define DX_MAGIC 0xD1C7
+
+struct dx_tail {
+	uint32_t	magic;				/* DX_MAGIC if the directory is indexed */
+	uint32_t	root_blk;			/* block holding the root dx_node */
+};
+
+struct dx_entry {
+	uint32_t	hash;				/* lowest name hash covered by block */
+	uint32_t	block;				/* dx_node (level > 0) or directory block (level 0) */
+};
+
+struct dx_node {
+	uint16_t	count;				/* number of entries in use */
+	uint16_t	level;				/* 0 if entries point at directory blocks */
+	uint32_t	reserved;
+	struct dx_entry entries[(BLOCK_SIZE - 8) / sizeof(struct dx_entry)];
+};
+
+/*
+ * Extent trees. On a filesystem made with TFS_FEATURE_EXTENTS, a regular
+ * file's direct_ptr/indirect_ptr area holds an extent_header followed by the
+ * root node's entries instead of block pointers. Entries of a node are
+ * sorted by file block. At depth 0 they are extents mapping length file
+ * blocks from block on to the disk blocks from start on; above that they are
+ * extent_idx entries pointing at a tree block (an extent_header plus
+ * entries) that maps the file blocks from block on. Files only grow at the
+ * end, so the tree only ever gains entries along its rightmost path.
+ */
+#define EXTENT_MAGIC 0xE7E7
+
+struct extent_header {
+	uint16_t	magic;				/* EXTENT_MAGIC */
+	uint16_t	entries;			/* number of entries in use */
+	uint16_t	max;				/* capacity of the node */
+	uint16_t	depth;				/* 0 if the entries are extents */
+};
+
+struct extent {
+	uint32_t	block;				/* first file block covered */
+	uint32_t	start;				/* disk block holding it */
+	uint32_t	length;				/* number of blocks in the run */
+};
+
+struct extent_idx {
+	uint32_t	block;				/* first file block covered by child */
+	uint32_t	child;				/* tree block one level down */
+	uint32_t	unused;				/* keeps entries the size of an extent */
+};
+
+#define EXTENT_ROOT_ENTRIES ((sizeof(int) * (MAX_DIRECT_POINTERS + MAX_INDIRECT_POINTERS) - sizeof(struct extent_header)) / sizeof(struct extent))
+#define EXTENT_BLOCK_ENTRIES ((BLOCK_SIZE - sizeof(struct extent_header)) / sizeof(struct extent))
 
 /*
  * bitmap operations